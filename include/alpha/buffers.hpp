@@ -13,104 +13,794 @@
 #ifndef BUFFERS_ALPHA_HPP
 #define BUFFERS_ALPHA_HPP
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 
+#include <alpha/image_io.hpp>
 #include <alpha/math.hpp>
+#include <alpha/simd.hpp>
 
 namespace alpha {
 namespace buffers {
 
 using RGB = alpha::math::Vec3<uint8_t>;
 
-class Zbuffer {
-  std::unique_ptr<float> depth_buffer;
-  uint32_t width, height;
+// Depth formats. A format turns depths into keys, the floats compared by
+// the depth test and stored, converted to its type, in a Depthbuffer. Keys
+// are computed from either the depth z or its inverse 1 / z, which the
+// rasteriser interpolates for perspective correct depth. Nearer keys are
+// smaller, unless the format is reversed. Formats are built from the near
+// and far clipping planes, and the far plane has the clear key.
+
+// Depths as they are, the default
+struct float_depth {
+  using type = float;
+  static constexpr bool reversed = false;
+  // Keys are depths
+  static constexpr bool exact = true;
   float far;
 
+  float_depth(float, float far) : far(far) {}
+
+  float clear_key() const { return far; }
+  float key(float z) const { return z; }
+  simd::vfloat key(simd::vfloat z) const { return z; }
+  float key_inverse(float w) const { return 1.f / w; }
+  simd::vfloat key_inverse(simd::vfloat w) const {
+    return simd::set1(1.f) / w;
+  }
+  float depth(float key) const { return key; }
+};
+
+// Reversed float depth, storing 1 / z: the rasteriser interpolates the key
+// itself, so the depth test needs no division per pixel. Floats are
+// densest near zero, which here is the far plane, offsetting the loss of
+// precision with distance that 1 / z suffers.
+struct reversed_float_depth {
+  using type = float;
+  static constexpr bool reversed = true;
+  static constexpr bool exact = false;
+  float far;
+
+  reversed_float_depth(float, float far) : far(far) {}
+
+  float clear_key() const { return 1.f / far; }
+  float key(float z) const { return 1.f / z; }
+  simd::vfloat key(simd::vfloat z) const { return simd::set1(1.f) / z; }
+  float key_inverse(float w) const { return w; }
+  simd::vfloat key_inverse(simd::vfloat w) const { return w; }
+  float depth(float key) const { return 1.f / key; }
+};
+
+// Normalised integer depth of Bits bits, as the window space depth of a
+// perspective projection: 0 at the near plane and the largest value at the
+// far plane, linear in 1 / z, so again the depth test needs no division.
+// Keys are whole numbers, exact in a float for up to 24 bits.
+template <typename T, uint32_t Bits>
+struct unorm_depth {
+  static_assert(Bits <= 24 && Bits <= 8 * sizeof(T),
+                "Keys must be exact in a float and fit the type");
+  using type = T;
+  static constexpr bool reversed = false;
+  static constexpr bool exact = false;
+  static constexpr float max_key = float((1u << Bits) - 1);
+  float inv_near, scale;
+
+  unorm_depth(float near, float far)
+    : inv_near(1.f / near), scale(max_key / (1.f / near - 1.f / far)) {}
+
+  float clear_key() const { return max_key; }
+  float key(float z) const { return key_inverse(1.f / z); }
+  simd::vfloat key(simd::vfloat z) const {
+    return key_inverse(simd::set1(1.f) / z);
+  }
+  // Depths beyond the far plane clamp to it, and so never pass
+  float key_inverse(float w) const {
+    return std::nearbyint(
+        std::min(std::max((inv_near - w) * scale, 0.f), max_key));
+  }
+  simd::vfloat key_inverse(simd::vfloat w) const {
+    simd::vfloat k = (simd::set1(inv_near) - w) * simd::set1(scale);
+    k = simd::min(simd::max(k, simd::set1(0.f)), simd::set1(max_key));
+    return simd::to_float(simd::to_int(k));
+  }
+  float depth(float key) const { return 1.f / (inv_near - key / scale); }
+};
+
+template <typename T, uint32_t Bits>
+constexpr float unorm_depth<T, Bits>::max_key;
+
+// Half the bandwidth of float_depth, at the cost of precision far away
+using unorm16_depth = unorm_depth<uint16_t, 16>;
+// Stored in 32 bits, with the top 8 spare, as GPUs do
+using unorm24_depth = unorm_depth<uint32_t, 24>;
+
+// Whether key a is nearer than key b, in Format's order
+template <typename Format>
+bool nearer(float a, float b) {
+  return Format::reversed ? b < a : a < b;
+}
+
+template <typename Format>
+simd::vmask nearer(simd::vfloat a, simd::vfloat b) {
+  return Format::reversed ? b < a : a < b;
+}
+
+// Keys to and from a vector of stored values
+inline simd::vfloat load_keys(const float *p) { return simd::load(p); }
+
+inline simd::vfloat load_keys(const uint16_t *p) {
+  return simd::to_float(simd::load(p));
+}
+
+inline simd::vfloat load_keys(const uint32_t *p) {
+  return simd::to_float(simd::load(reinterpret_cast<const int32_t *>(p)));
+}
+
+inline void store_keys(float *p, simd::vfloat k) { simd::store(p, k); }
+
+inline void store_keys(uint16_t *p, simd::vfloat k) {
+  simd::store(p, simd::to_int(k));
+}
+
+inline void store_keys(uint32_t *p, simd::vfloat k) {
+  simd::store(reinterpret_cast<int32_t *>(p), simd::to_int(k));
+}
+
+// The Depthbuffer keeps the farthest key of every square block of
+// hiz_block_size pixels, and of every tile of hiz_tile_blocks blocks a side.
+constexpr uint32_t hiz_block_size = 8;
+constexpr uint32_t hiz_tile_blocks = 8;
+
+// Depth and image buffers clear lazily, in square tiles of clear_tile_size
+// pixels: clear() only marks every tile cleared, and a tile is filled with
+// the clear value when it is first written. Reads of a cleared tile give
+// the clear value without filling it. Different tiles may be filled from
+// different threads.
+constexpr uint32_t clear_tile_size = hiz_block_size * hiz_tile_blocks;
+
+// Memory layouts, mapping pixel (x, y) to its offset in a buffer. In both
+// the hiz_block_size pixels of a block row are contiguous, so vector loads
+// and stores of a block row need one offset. Widths are padded to at least
+// a whole block, so that they never run past the end of the buffer.
+
+// Row-major. Rows are padded to 16 values, so that the rows of 32 bit
+// values in a cache aligned buffer start on cache lines.
+struct linear_layout {
+  uint32_t stride, height;
+
+  linear_layout(uint32_t w, uint32_t h) : stride((w + 15) & ~15u), height(h) {}
+
+  size_t size() const { return size_t(stride) * height; }
+
+  size_t offset(uint32_t x, uint32_t y) const {
+    return size_t(y) * stride + x;
+  }
+};
+
+// Blocks stored whole, row-major within, and the blocks of each clear tile
+// in Morton order, so that a tile is contiguous and neighbouring blocks
+// mostly share pages. Tiles are row-major. A triangle's pixels then touch
+// far fewer cache lines and pages than a row-major buffer's.
+struct tiled_layout {
+  static_assert(hiz_block_size == 8 && hiz_tile_blocks == 8,
+                "Offsets are built from 3 bit fields");
+  uint32_t tiles_x, tiles_y;
+
+  tiled_layout(uint32_t w, uint32_t h)
+    : tiles_x((w + clear_tile_size - 1) / clear_tile_size),
+      tiles_y((h + clear_tile_size - 1) / clear_tile_size) {}
+
+  size_t size() const {
+    return size_t(tiles_x) * tiles_y * clear_tile_size * clear_tile_size;
+  }
+
+  size_t offset(uint32_t x, uint32_t y) const {
+    size_t tile = size_t(y >> 6) * tiles_x + (x >> 6);
+    uint32_t block = spread((x >> 3) & 7) | spread((y >> 3) & 7) << 1;
+    return tile << 12 | block << 6 | (y & 7) << 3 | (x & 7);
+  }
+
+  private:
+  // Bits 0, 1, 2 of v to bits 0, 2, 4
+  static uint32_t spread(uint32_t v) {
+    return (v & 1) | (v & 2) << 1 | (v & 4) << 2;
+  }
+};
+
+// Storage for n values aligned to a cache line. Only types which need
+// constructing are constructed, so the memory of the others is not
+// touched until it is written.
+template <typename T>
+class aligned_array {
+  static_assert(std::is_trivially_destructible<T>::value,
+                "Items are never destroyed");
+  static constexpr size_t alignment = 64;
+  std::unique_ptr<char[]> storage;
+  T *items;
+
+  public:
+  explicit aligned_array(size_t n)
+    : storage(new char[n * sizeof(T) + alignment - 1]) {
+    auto base = reinterpret_cast<uintptr_t>(storage.get());
+    items = reinterpret_cast<T *>((base + alignment - 1) &
+                                  ~uintptr_t(alignment - 1));
+    if (!std::is_trivially_default_constructible<T>::value) {
+      for (size_t i = 0; i < n; ++i) {
+        new (items + i) T;
+      }
+    }
+  }
+
+  T *get() const { return items; }
+
+  T &operator[](size_t i) const { return items[i]; }
+};
+
+// Where a Framebuffer keeps its pixels: in an aligned_array, or in an image
+// file mapped into memory, after its header, so that the pixels are the
+// file's contents.
+template <typename T>
+class pixel_storage {
+  std::unique_ptr<aligned_array<T>> heap;
+#ifdef ALPHA_POSIX_IO
+  std::unique_ptr<io::mapped_file> file;
+#endif
+  T *items;
+
+  public:
+  explicit pixel_storage(size_t n)
+    : heap(new aligned_array<T>(n)), items(heap->get()) {}
+
+  // Create the file name, holding header and then n items. The header's
+  // size must keep the items aligned.
+  pixel_storage(const std::string &name, const std::string &header,
+                size_t n) {
+    static_assert(std::is_trivial<T>::value, "Items are the file's bytes");
+#ifdef ALPHA_POSIX_IO
+    file.reset(new io::mapped_file(name, header.size() + n * sizeof(T)));
+    memcpy(file->data(), header.data(), header.size());
+    items = reinterpret_cast<T *>(file->data() + header.size());
+#else
+    (void)name, (void)header, (void)n;
+    throw std::runtime_error("Mapped files are not supported");
+#endif
+  }
+
+  T *get() const { return items; }
+
+  bool mapped() const { return !heap; }
+
+  // Write a mapped file's contents back, see io::mapped_file
+  void sync(bool wait) {
+#ifdef ALPHA_POSIX_IO
+    if (file) {
+      file->sync(wait);
+    }
+#else
+    (void)wait;
+#endif
+  }
+};
+
+template <typename Format = float_depth, typename Layout = linear_layout>
+class Depthbuffer {
+  using T = typename Format::type;
+  uint32_t width, height;
+  Layout layout;
+  aligned_array<T> depth_buffer;
+  Format fmt;
+  // Coarse farthest keys. Depths normally only decrease, so a stale bound
+  // still holds: blocks are refreshed by update_block, and tiles lazily
+  // from their blocks.
+  uint32_t blocks_x, blocks_y, tiles_x, tiles_y;
+  std::vector<float> block_max, tile_max;
+  std::vector<uint8_t> tile_dirty;
+  // Depth tiles are the bounds' tiles
+  std::vector<uint8_t> cleared;
+
   public:
-  Zbuffer() = delete;
+  Depthbuffer() = delete;
 
-  Zbuffer(uint32_t w, uint32_t h, float far) : width(w), height(h), far(far) {
-    depth_buffer = std::unique_ptr<float>(new float[w * h]);
-    for(uint32_t i = 0; i < width * height; ++i)
-      depth_buffer.get()[i] = far;
+  Depthbuffer(uint32_t w, uint32_t h, float far, float near = 1.f)
+    : width(w), height(h), layout(w, h), depth_buffer(layout.size()),
+      fmt(near, far) {
+    blocks_x = (w + hiz_block_size - 1) / hiz_block_size;
+    blocks_y = (h + hiz_block_size - 1) / hiz_block_size;
+    tiles_x = (blocks_x + hiz_tile_blocks - 1) / hiz_tile_blocks;
+    tiles_y = (blocks_y + hiz_tile_blocks - 1) / hiz_tile_blocks;
+    block_max.resize(blocks_x * blocks_y);
+    tile_max.resize(tiles_x * tiles_y);
+    tile_dirty.resize(tiles_x * tiles_y);
+    cleared.resize(tiles_x * tiles_y);
+    clear();
   }
 
+  const Format &format() const { return fmt; }
+
   void clear() {
-      std::fill(depth_buffer.get(), depth_buffer.get() + width * height, far);
+      const float k = fmt.clear_key();
+      std::fill(block_max.begin(), block_max.end(), k);
+      std::fill(tile_max.begin(), tile_max.end(), k);
+      std::fill(tile_dirty.begin(), tile_dirty.end(), 0);
+      std::fill(cleared.begin(), cleared.end(), 1);
+  }
+
+  bool tile_cleared(uint32_t tx, uint32_t ty) const {
+    return cleared[ty * tiles_x + tx];
   }
 
+  // Fill tile (tx, ty) with the clear value, if it is still marked
+  // cleared. Must be called before writing through span().
+  void resolve_tile(uint32_t tx, uint32_t ty) {
+    uint32_t t = ty * tiles_x + tx;
+    if (!cleared[t]) {
+      return;
+    }
+    const T k = static_cast<T>(fmt.clear_key());
+    // The last blocks of a row take the padding with them
+    uint32_t x0 = tx * clear_tile_size;
+    uint32_t x1 = std::min(blocks_x * hiz_block_size, x0 + clear_tile_size);
+    uint32_t y1 = std::min(height, (ty + 1) * clear_tile_size);
+    for (uint32_t y = ty * clear_tile_size; y < y1; ++y) {
+      for (uint32_t x = x0; x < x1; x += hiz_block_size) {
+        std::fill(span(x, y), span(x, y) + hiz_block_size, k);
+      }
+    }
+    cleared[t] = 0;
+  }
+
+  // The bounds are raised to cover z, so they still hold if it is farther
+  // than the depth it replaces.
   void set(uint32_t x, uint32_t y, float z) {
-    depth_buffer.get()[y * width + x] = z;
+    resolve_tile(x / clear_tile_size, y / clear_tile_size);
+    const T k = static_cast<T>(fmt.key(z));
+    *span(x, y) = k;
+    const uint32_t bx = x / hiz_block_size, by = y / hiz_block_size;
+    float &m = block_max[by * blocks_x + bx];
+    if (nearer<Format>(m, float(k))) {
+      m = float(k);
+      tile_dirty[(by / hiz_tile_blocks) * tiles_x + bx / hiz_tile_blocks] = 1;
+    }
   }
 
+  // The depth at (x, y), as far as the format keeps it
   float get(uint32_t x, uint32_t y) {
-    return depth_buffer.get()[y * width + x];
+    float key = tile_cleared(x / clear_tile_size, y / clear_tile_size)
+                    ? fmt.clear_key()
+                    : float(*span(x, y));
+    return fmt.depth(key);
   }
 
-  void dump_as_ppm(const std::string &name) {
-    std::ofstream file_h(name, std::fstream::binary);
-    file_h << "P6 " << width << " " << height << " " << 255 << " ";
-    for (uint32_t i = 0; i < width * height; ++i) {
-      // Map range [1, 1000] to [0, 255]
-      float elem = depth_buffer.get()[i];
-      elem = (elem - 1) * 0.255f;
-      uint8_t print = static_cast<uint8_t>(std::round(elem));
-      file_h << print << print << print;
+  // The stored key of (x, y), followed by the rest of its block row. The
+  // tiles read or written must have been resolved.
+  T *span(uint32_t x, uint32_t y) {
+    return depth_buffer.get() + layout.offset(x, y);
+  }
+
+  // Bound on the key of every pixel in block (bx, by): none is farther.
+  float max_depth_block(uint32_t bx, uint32_t by) {
+    return block_max[by * blocks_x + bx];
+  }
+
+  // Bound on the key of every pixel in tile (tx, ty).
+  float max_depth_tile(uint32_t tx, uint32_t ty) {
+    uint32_t t = ty * tiles_x + tx;
+    if (tile_dirty[t]) {
+      uint32_t bx1 = std::min(blocks_x, (tx + 1) * hiz_tile_blocks);
+      uint32_t by1 = std::min(blocks_y, (ty + 1) * hiz_tile_blocks);
+      float m = nearest();
+      for (uint32_t by = ty * hiz_tile_blocks; by < by1; ++by) {
+        for (uint32_t bx = tx * hiz_tile_blocks; bx < bx1; ++bx) {
+          m = farther(m, block_max[by * blocks_x + bx]);
+        }
+      }
+      tile_max[t] = m;
+      tile_dirty[t] = 0;
     }
-    file_h.close();
+    return tile_max[t];
+  }
+
+  // Recompute the farthest key of block (bx, by). Must be called after a
+  // depth in it is increased through span(); calling it after writing
+  // smaller depths tightens the bound.
+  void update_block(uint32_t bx, uint32_t by) {
+    uint32_t x0 = bx * hiz_block_size, y0 = by * hiz_block_size;
+    uint32_t x1 = std::min(width, x0 + hiz_block_size);
+    uint32_t y1 = std::min(height, y0 + hiz_block_size);
+    float m = nearest();
+    if (tile_cleared(bx / hiz_tile_blocks, by / hiz_tile_blocks)) {
+      y1 = y0;
+      m = fmt.clear_key();
+    }
+    for (uint32_t y = y0; y < y1; ++y) {
+      const T *r = span(x0, y);
+      for (uint32_t x = 0; x < x1 - x0; ++x) {
+        m = farther(m, float(r[x]));
+      }
+    }
+    block_max[by * blocks_x + bx] = m;
+    tile_dirty[(by / hiz_tile_blocks) * tiles_x + bx / hiz_tile_blocks] = 1;
+  }
+
+  void dump_as_ppm(const std::string &name,
+                   io::write_mode mode = io::write_mode::Buffered) {
+    io::write_image(name, io::ppm_header(width, height), height, 3 * width,
+                    [this](uint32_t y, uint8_t *out) {
+                      for (uint32_t x = 0; x < width; ++x) {
+                        // Map range [1, 1000] to [0, 255]
+                        float elem = (get(x, y) - 1) * 0.255f;
+                        uint8_t print = static_cast<uint8_t>(std::round(elem));
+                        out[3 * x] = out[3 * x + 1] = out[3 * x + 2] = print;
+                      }
+                    },
+                    mode);
+  }
+
+  private:
+  static float nearest() {
+    return Format::reversed ? std::numeric_limits<float>::infinity() : 0.f;
+  }
+
+  static float farther(float a, float b) {
+    return nearer<Format>(a, b) ? b : a;
+  }
+};
+
+using Zbuffer = Depthbuffer<float_depth>;
+
+// Colour formats, how a Framebuffer stores a pixel. rgb8_colour stores RGB
+// itself. The others pack a pixel into 32 bits with an opaque alpha, so
+// that runs of pixels are copied or stored a vector at a time, and rows are
+// in the layout viewers upload.
+struct rgb8_colour {
+  using type = RGB;
+  static constexpr bool packed = false;
+
+  static void store(type &p, uint8_t r, uint8_t g, uint8_t b) {
+    p[0] = r;
+    p[1] = g;
+    p[2] = b;
+  }
+  // The pixel as Framebuffer::get returns it, which may be written
+  static RGB &colour(type &p) { return p; }
+};
+
+// A packed pixel with its bytes in memory in the order C0, C1, C2, A
+template <int R, int G, int B>
+struct packed_colour {
+  using type = uint32_t;
+  static constexpr bool packed = true;
+
+  static type pack(uint8_t r, uint8_t g, uint8_t b) {
+    uint8_t bytes[4];
+    bytes[R] = r;
+    bytes[G] = g;
+    bytes[B] = b;
+    bytes[3] = 255;
+    type p;
+    memcpy(&p, bytes, sizeof(p));
+    return p;
+  }
+  static void store(type &p, uint8_t r, uint8_t g, uint8_t b) {
+    p = pack(r, g, b);
+  }
+  static RGB colour(const type &p) {
+    uint8_t bytes[4];
+    memcpy(bytes, &p, sizeof(p));
+    return RGB(bytes[R], bytes[G], bytes[B]);
   }
 };
 
-class Imagebuffer {
-  std::unique_ptr<RGB> buffer;
+using rgba8_colour = packed_colour<0, 1, 2>;
+using bgra8_colour = packed_colour<2, 1, 0>;
+
+template <typename Format = rgb8_colour, typename Layout = linear_layout>
+class Framebuffer {
+  using T = typename Format::type;
   uint32_t width, height;
+  Layout layout;
+  pixel_storage<T> buffer;
+  uint32_t tiles_x;
+  // Tiles still to be filled with black
+  std::vector<uint8_t> cleared;
 
  public:
   int col_space;
 
-  Imagebuffer() = delete;
+  Framebuffer() = delete;
 
-  Imagebuffer(uint32_t w, uint32_t h, int space = 255)
-    : width(w), height(h), col_space(space) {
-      buffer = std::unique_ptr<RGB>(new RGB[width * height]);
+  // Starts out cleared, so a new buffer is black without touching it
+  Framebuffer(uint32_t w, uint32_t h, int space = 255)
+    : width(w), height(h), layout(w, h), buffer(layout.size()),
+      col_space(space) {
+      tiles_x = (w + clear_tile_size - 1) / clear_tile_size;
+      cleared.resize(tiles_x * ((h + clear_tile_size - 1) / clear_tile_size));
+      clear();
+    }
+
+  // Render straight into the file name, an RGBA PAM image, with no dump
+  // step. Its pixels are complete once sync() returns. The width must be a
+  // multiple of 16, so that rows have no padding.
+  Framebuffer(const std::string &name, uint32_t w, uint32_t h)
+    : width(unpadded(w, h)), height(h), layout(w, h),
+      buffer(name, io::pam_header(w, h), layout.size()), col_space(255) {
+      static_assert(std::is_same<Format, rgba8_colour>::value &&
+                        std::is_same<Layout, linear_layout>::value,
+                    "Image files hold linear RGBA");
+      tiles_x = (w + clear_tile_size - 1) / clear_tile_size;
+      cleared.resize(tiles_x * ((h + clear_tile_size - 1) / clear_tile_size));
+      clear();
     }
 
   void clear() {
-    memset(buffer.get(), 0, width * height * sizeof(RGB));
+    std::fill(cleared.begin(), cleared.end(), 1);
+  }
+
+  bool mapped() const { return buffer.mapped(); }
+
+  // End a frame. A mapped buffer fills its cleared tiles and starts writing
+  // its pixels to the file, and with wait returns once they are on disk;
+  // otherwise this does nothing.
+  void sync(bool wait = false) {
+    if (buffer.mapped()) {
+      resolve();
+      buffer.sync(wait);
+    }
+  }
+
+  bool tile_cleared(uint32_t tx, uint32_t ty) const {
+    return cleared[ty * tiles_x + tx];
+  }
+
+  // Fill tile (tx, ty) with black, if it is still marked cleared.
+  void resolve_tile(uint32_t tx, uint32_t ty) {
+    uint32_t t = ty * tiles_x + tx;
+    if (!cleared[t]) {
+      return;
+    }
+    T black;
+    Format::store(black, 0, 0, 0);
+    uint32_t x0 = tx * clear_tile_size;
+    uint32_t x1 = std::min(width, x0 + clear_tile_size);
+    uint32_t y1 = std::min(height, (ty + 1) * clear_tile_size);
+    for (uint32_t y = ty * clear_tile_size; y < y1; ++y) {
+      for (uint32_t x = x0; x < x1; x += hiz_block_size) {
+        uint32_t n = std::min(hiz_block_size, x1 - x);
+        std::fill(span(x, y), span(x, y) + n, black);
+      }
+    }
+    cleared[t] = 0;
+  }
+
+  // Mark tile (tx, ty) filled without filling it, for a caller about to
+  // store every pixel in it through span().
+  void claim_tile(uint32_t tx, uint32_t ty) {
+    cleared[ty * tiles_x + tx] = 0;
+  }
+
+  // Clear tile (tx, ty) alone
+  void clear_tile(uint32_t tx, uint32_t ty) {
+    cleared[ty * tiles_x + tx] = 1;
+  }
+
+  // Fill every tile still marked cleared, as before reading span()
+  void resolve() {
+    for (uint32_t t = 0; t < cleared.size(); ++t) {
+      resolve_tile(t % tiles_x, t / tiles_x);
+    }
   }
 
   void set(uint32_t x, uint32_t y, uint8_t r, uint8_t g, uint8_t b) {
-    buffer.get()[y * width + x][0] = r;
-    buffer.get()[y * width + x][1] = g;
-    buffer.get()[y * width + x][2] = b;
+    Format::store(pixel(x, y), r, g, b);
   }
 
-  RGB& get(int x, int y) {
-    return buffer.get()[y * width + x];
+  // Store the packed pixels p[0, n) from (x, y) on, which must lie in one
+  // block row.
+  void set_run(uint32_t x, uint32_t y, const T *p, uint32_t n) {
+    resolve_tile(x / clear_tile_size, y / clear_tile_size);
+    memcpy(span(x, y), p, n * sizeof(T));
+  }
+
+  // For rgb8_colour a reference to the pixel, which may be written; for
+  // packed formats its colour.
+  auto get(int x, int y) -> decltype(Format::colour(std::declval<T &>())) {
+    return Format::colour(pixel(uint32_t(x), uint32_t(y)));
+  }
+
+  // The stored pixel, whose tile is filled
+  T &pixel(uint32_t x, uint32_t y) {
+    resolve_tile(x / clear_tile_size, y / clear_tile_size);
+    return *span(x, y);
+  }
+
+  // The stored pixel (x, y), followed by the rest of its block row. The
+  // tiles read or written must have been resolved. With linear_layout,
+  // span(0, y) is the whole of row y, starting on a cache line.
+  T *span(uint32_t x, uint32_t y) {
+    return buffer.get() + layout.offset(x, y);
   }
 
   void dump_to_stream(std::ostream& ss) {
-    // std::ofstream file_h(name, std::fstream::binary);
-    ss << "P6 " << width << " " << height << " " << col_space << " ";
-    for(auto *i = buffer.get(); i != buffer.get() + width * height; ++i) {
-      ss << (*i)[0] << (*i)[1] << (*i)[2];
+    io::write_image(ss, io::ppm_header(width, height, col_space), height,
+                    3 * width, [this](uint32_t y, uint8_t *out) {
+                      convert_row(y, out);
+                    });
+  }
+
+  void dump_as_ppm(const std::string &name,
+                   io::write_mode mode = io::write_mode::Buffered) {
+    io::write_image(name, io::ppm_header(width, height, col_space), height,
+                    3 * width, [this](uint32_t y, uint8_t *out) {
+                      convert_row(y, out);
+                    },
+                    mode);
+  }
+
+  // Losslessly compressed, as QOI
+  void dump_qoi_to_stream(std::ostream &ss) {
+    io::write_qoi(ss, width, height, [this](uint32_t y, uint8_t *out) {
+      convert_row(y, out);
+    });
+  }
+
+  void dump_as_qoi(const std::string &name) {
+    io::write_qoi(name, width, height, [this](uint32_t y, uint8_t *out) {
+      convert_row(y, out);
+    });
+  }
+
+ private:
+  // The width, checked before an image file is created for it
+  static uint32_t unpadded(uint32_t w, uint32_t h) {
+    if (Layout(w, h).stride != w) {
+      throw std::invalid_argument("Width must be a multiple of 16");
+    }
+    return w;
+  }
+
+  // Row y as RGB bytes, whatever the layout, and without alpha. Cleared
+  // tiles are written as black, and left cleared.
+  void convert_row(uint32_t y, uint8_t *out) {
+    const uint8_t *clear_row = &cleared[(y / clear_tile_size) * tiles_x];
+    for (uint32_t x0 = 0; x0 < width; x0 += clear_tile_size) {
+      uint32_t x1 = std::min(width, x0 + clear_tile_size);
+      if (clear_row[x0 / clear_tile_size]) {
+        std::memset(out + 3 * x0, 0, 3 * (x1 - x0));
+        continue;
+      }
+      // A block row at a time, which span() keeps contiguous
+      for (uint32_t bx = x0; bx < x1; bx += hiz_block_size) {
+        T *p = span(bx, y);
+        uint32_t n = std::min(x1 - bx, hiz_block_size);
+        for (uint32_t i = 0; i < n; ++i) {
+          const auto &c = Format::colour(p[i]);
+          uint8_t *o = out + 3 * (bx + i);
+          o[0] = c[0];
+          o[1] = c[1];
+          o[2] = c[2];
+        }
+      }
+    }
+  }
+};
+
+using Imagebuffer = Framebuffer<>;
+
+// Depth and colour for every sample of every pixel, used for multisample
+// anti-aliasing. resolve() averages the samples of each pixel.
+class Multisamplebuffer {
+  std::unique_ptr<float[]> depth_buffer;
+  std::unique_ptr<uint8_t[]> color_buffer;
+  uint32_t width, height, samples;
+  // log2(samples), so that averaging is a shift
+  uint32_t shift = 0;
+  float far;
+  // Tiles which may have been drawn to since they were last cleared
+  uint32_t tiles_x;
+  std::vector<uint8_t> touched;
+
+  size_t size() const { return size_t(width) * height * samples; }
+
+  public:
+  Multisamplebuffer() = delete;
+
+  // The number of samples must be a power of two.
+  Multisamplebuffer(uint32_t w, uint32_t h, uint32_t n, float far)
+    : width(w), height(h), samples(n), far(far) {
+    if (n == 0 || (n & (n - 1)) != 0) {
+      throw std::invalid_argument("Sample count must be a power of two");
     }
+    while ((1u << shift) < n) {
+      ++shift;
+    }
+    depth_buffer = std::unique_ptr<float[]>(new float[size()]);
+    color_buffer = std::unique_ptr<uint8_t[]>(new uint8_t[size() * 3]);
+    std::fill(depth_buffer.get(), depth_buffer.get() + size(), far);
+    std::fill(color_buffer.get(), color_buffer.get() + size() * 3, 0);
+    tiles_x = (w + clear_tile_size - 1) / clear_tile_size;
+    touched.resize(tiles_x * ((h + clear_tile_size - 1) / clear_tile_size));
+  }
+
+  // Only the tiles touched since the last clear are reset
+  void clear() {
+    for (uint32_t t = 0; t < touched.size(); ++t) {
+      if (!touched[t]) {
+        continue;
+      }
+      uint32_t x0 = (t % tiles_x) * clear_tile_size;
+      uint32_t n = std::min(clear_tile_size, width - x0);
+      uint32_t y0 = (t / tiles_x) * clear_tile_size;
+      uint32_t y1 = std::min(height, y0 + clear_tile_size);
+      for (uint32_t y = y0; y < y1; ++y) {
+        std::fill(depths(x0, y), depths(x0, y) + n * samples, far);
+        std::fill(colors(x0, y), colors(x0, y) + n * samples * 3, 0);
+      }
+      touched[t] = 0;
+    }
+  }
+
+  // Note that the samples of pixel (x, y) may be written
+  void touch(uint32_t x, uint32_t y) {
+    touched[(y / clear_tile_size) * tiles_x + x / clear_tile_size] = 1;
+  }
+
+  uint32_t num_samples() const { return samples; }
+
+  // The depths of the samples of pixel (x, y).
+  float *depths(uint32_t x, uint32_t y) {
+    return depth_buffer.get() + (size_t(y) * width + x) * samples;
+  }
+
+  // The colours of the samples of pixel (x, y), as r, g, b bytes.
+  uint8_t *colors(uint32_t x, uint32_t y) {
+    return color_buffer.get() + (size_t(y) * width + x) * samples * 3;
   }
 
-  void dump_as_ppm(const std::string &name) {
-    std::ofstream file_h(name, std::fstream::binary);
-    file_h << "P6 " << width << " " << height << " " << col_space << " ";
-    for(auto *i = buffer.get(); i != buffer.get() + width * height; ++i) {
-      file_h << (*i)[0] << (*i)[1] << (*i)[2];
+  // Write the average of the samples of each pixel to img, a block row at
+  // a time. Untouched tiles average to black, so img's are just cleared;
+  // the others have every pixel stored, so are claimed rather than filled.
+  template <typename Format, typename Layout>
+  void resolve(Framebuffer<Format, Layout> &img) {
+    for (uint32_t t = 0; t < touched.size(); ++t) {
+      const uint32_t tx = t % tiles_x, ty = t / tiles_x;
+      if (!touched[t]) {
+        img.clear_tile(tx, ty);
+        continue;
+      }
+      img.claim_tile(tx, ty);
+      uint32_t x1 = std::min(width, (tx + 1) * clear_tile_size);
+      uint32_t y1 = std::min(height, (ty + 1) * clear_tile_size);
+      for (uint32_t y = ty * clear_tile_size; y < y1; ++y) {
+        for (uint32_t x0 = tx * clear_tile_size; x0 < x1;
+             x0 += hiz_block_size) {
+          auto *p = img.span(x0, y);
+          const uint8_t *c = colors(x0, y);
+          const uint32_t n = std::min(hiz_block_size, x1 - x0);
+          for (uint32_t i = 0; i < n; ++i) {
+            uint32_t sum[3] = {0, 0, 0};
+            for (uint32_t s = 0; s < samples; ++s, c += 3) {
+              sum[0] += c[0];
+              sum[1] += c[1];
+              sum[2] += c[2];
+            }
+            Format::store(p[i], uint8_t((sum[0] + samples / 2) >> shift),
+                          uint8_t((sum[1] + samples / 2) >> shift),
+                          uint8_t((sum[2] + samples / 2) >> shift));
+          }
+        }
+      }
     }
-    file_h.close();
   }
 };
 
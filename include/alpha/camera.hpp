@@ -92,6 +92,8 @@ public:
 
     float get_far_clipping_plain() { return far_clipping_plain; }
 
+    float get_near_clipping_plain() { return near_clipping_plain; }
+
     void compute_screen_coordinates() {
         // Implements a pinhole camera model
         float film_aspect_ratio = film_aperture_width / film_aperture_height;
@@ -161,10 +163,19 @@ public:
 #ifdef ALPHA_DEBUG
         std::cout << "\nWorld co-ords" << v_world;
 #endif
-        world_to_cam.mult_vec_matrix(v_world, v_cam);
+        convert_to_camera(v_world, v_cam);
 #ifdef ALPHA_DEBUG
         std::cout << "\nCam co-ords" << v_cam;
 #endif
+        project_to_raster(v_cam, raster);
+    }
+
+    void convert_to_camera(const math::Vec3f &v_world, math::Vec3f &v_cam) {
+        world_to_cam.mult_vec_matrix(v_world, v_cam);
+    }
+
+    // Project a camera space point in front of the camera to raster space.
+    void project_to_raster(const math::Vec3f &v_cam, math::Vec3f &raster) {
         // Convert to clip space
         math::Vec3f v_clip;
         M_proj.mult_vec_matrix(v_cam, v_clip);
@@ -175,6 +186,16 @@ public:
         raster.z = -v_cam.z;
     }
 
+    // Homogeneous clip co-ordinates of a camera space point, before the
+    // divide by w. The view frustum is |x| <= w, |y| <= w, with w the
+    // distance in front of the camera.
+    void convert_to_clip(const math::Vec3f &v_cam, float &x, float &y,
+                         float &w) {
+        x = v_cam.x * M_proj[0][0];
+        y = v_cam.y * M_proj[1][1];
+        w = -v_cam.z;
+    }
+
     void convert_to_raster(const math::Vec3f &v_world, math::Vec3f &raster) {
         math::Vec3f v_cam;
         convert_to_raster(v_world, raster, v_cam);
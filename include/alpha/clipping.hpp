@@ -0,0 +1,135 @@
+//===---- clipping --------- Clip space geometry stage ----------*- C++ -*-===//
+//
+// Alpha-trace -> Minimal C++ raytracer
+//
+// Written by: Shikhar Bhardwaj | shikhar@bluefog.me
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Frustum culling, and clipping of triangles against the near plane and a
+/// guard band. The rasteriser clamps bounding boxes to the screen, so the
+/// other frustum planes never need clipping; the guard band only keeps raster
+/// co-ordinates small enough for its fixed point edge functions.
+///
+//===----------------------------------------------------------------------===//
+#ifndef ALPHA_CLIPPING
+#define ALPHA_CLIPPING
+
+#include <cmath>
+#include <cstdint>
+#include <utility>
+
+#include "camera.hpp"
+#include "math.hpp"
+
+namespace alpha {
+namespace clipping {
+
+// Outcodes, the frustum planes a camera space point is outside of. A
+// triangle whose vertices share any of these is not visible. Clip marks
+// points behind the near plane or outside the guard band, which need the
+// triangles using them clipped; it is not a plane, so takes no part in
+// culling.
+enum outcode : uint32_t {
+    Left = 1, Right = 2, Bottom = 4, Top = 8, Near = 16, Far = 32, Clip = 64
+};
+
+// Distance from the edges of the screen to the guard band, in pixels
+constexpr float guard_band = float(1 << 22);
+
+// Vertices of a clipped polygon can number at most 3 + 1 per plane
+constexpr uint32_t max_vertices = 8;
+
+// A polygon vertex: its position in camera space, and its barycentric
+// co-ordinates in the triangle being clipped.
+struct Vertex {
+    math::Vec3f cam;
+    float b[3];
+};
+
+// The guard band in clip space is |x| <= gx * w, |y| <= gy * w.
+inline void guard_band_scale(const Camera &cam, float &gx, float &gy) {
+    gx = 1 + 2 * guard_band / cam.img_width;
+    gy = 1 + 2 * guard_band / cam.img_height;
+}
+
+inline uint32_t compute_outcode(Camera &cam, const math::Vec3f &v_cam) {
+    float x, y, w, gx, gy;
+    cam.convert_to_clip(v_cam, x, y, w);
+    guard_band_scale(cam, gx, gy);
+    uint32_t code = 0;
+    code |= x < -w ? uint32_t(Left) : 0;
+    code |= x > w ? uint32_t(Right) : 0;
+    code |= y < -w ? uint32_t(Bottom) : 0;
+    code |= y > w ? uint32_t(Top) : 0;
+    code |= w < cam.get_near_clipping_plain() ? uint32_t(Near | Clip) : 0;
+    code |= w > cam.get_far_clipping_plain() ? uint32_t(Far) : 0;
+    code |= (std::fabs(x) > gx * w || std::fabs(y) > gy * w) ? uint32_t(Clip)
+                                                              : 0;
+    return code;
+}
+
+// One step of Sutherland-Hodgman: clip the polygon in[0, n) to the side
+// of a plane where dist(v) >= 0. Returns the number of vertices in out.
+template <typename Distance>
+uint32_t clip_polygon(const Vertex *in, uint32_t n, Vertex *out,
+                      Distance &&dist) {
+    uint32_t m = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        const Vertex &a = in[i], &b = in[(i + 1) % n];
+        float da = dist(a), db = dist(b);
+        if (da >= 0) {
+            out[m++] = a;
+        }
+        if ((da >= 0) != (db >= 0)) {
+            // The edge crosses the plane
+            float t = da / (da - db);
+            Vertex &v = out[m++];
+            v.cam = a.cam + (b.cam - a.cam) * t;
+            for (int j = 0; j < 3; ++j) {
+                v.b[j] = a.b[j] + (b.b[j] - a.b[j]) * t;
+            }
+        }
+    }
+    return m;
+}
+
+// Clip a camera space triangle against the near plane and the guard band.
+// Returns the number of vertices of the remaining convex polygon in out,
+// which has room for max_vertices. Fewer than 3 means nothing is left.
+inline uint32_t clip_triangle(Camera &cam, const math::Vec3f &v0,
+                              const math::Vec3f &v1, const math::Vec3f &v2,
+                              Vertex *out) {
+    Vertex a[max_vertices] = {{v0, {1, 0, 0}}, {v1, {0, 1, 0}},
+                              {v2, {0, 0, 1}}};
+    Vertex b[max_vertices];
+    const float near = cam.get_near_clipping_plain();
+    float gx, gy;
+    guard_band_scale(cam, gx, gy);
+    uint32_t n = 3;
+    n = clip_polygon(a, n, b, [&](const Vertex &v) {
+        return -v.cam.z - near;
+    });
+    // Guard band planes, as (sign of x, sign of y, scale)
+    const float planes[4][3] = {
+        {1, 0, gx}, {-1, 0, gx}, {0, 1, gy}, {0, -1, gy}};
+    Vertex *in = b, *res = a;
+    for (auto &p : planes) {
+        n = clip_polygon(in, n, res, [&](const Vertex &v) {
+            float x, y, w;
+            cam.convert_to_clip(v.cam, x, y, w);
+            return p[2] * w - p[0] * x - p[1] * y;
+        });
+        std::swap(in, res);
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        out[i] = in[i];
+    }
+    return n;
+}
+
+} // namespace clipping
+} // namespace alpha
+
+#endif
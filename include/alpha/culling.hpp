@@ -0,0 +1,161 @@
+//===---- culling ---------- Triangle visibility pass -----------*- C++ -*-===//
+//
+// Alpha-trace -> Minimal C++ raytracer
+//
+// Written by: Shikhar Bhardwaj | shikhar@bluefog.me
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// A culling pass which needs no buffers. Each vertex is projected once, and
+/// every triangle is classified as visible, back facing, off screen or
+/// degenerate, giving the list of triangles worth drawing.
+///
+//===----------------------------------------------------------------------===//
+#ifndef ALPHA_CULLING
+#define ALPHA_CULLING
+
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "camera.hpp"
+#include "clipping.hpp"
+#include "math.hpp"
+
+namespace alpha {
+namespace culling {
+
+enum class result : uint8_t { Visible = 0, BackFacing, OffScreen, Degenerate };
+
+// Raster space triangles with less area than this, in square pixels, are
+// degenerate: snapped to the rasteriser's 1/16 pixel grid they have none.
+constexpr float min_area = 1.f / 512;
+
+struct Vertex {
+    math::Vec3f cam, raster;
+    uint32_t outcode;
+};
+
+inline void project(Camera &cam, const math::Vec3f &v_world, Vertex &v) {
+    cam.convert_to_raster(v_world, v.raster, v.cam);
+    v.outcode = clipping::compute_outcode(cam, v.cam);
+}
+
+// Front faces wind counter-clockwise on screen, as in the rasteriser.
+inline result classify(const Vertex &v0, const Vertex &v1, const Vertex &v2) {
+    // Outside the same frustum plane
+    if (v0.outcode & v1.outcode & v2.outcode & ~clipping::Clip) {
+        return result::OffScreen;
+    }
+    float area;
+    if ((v0.outcode | v1.outcode | v2.outcode) & clipping::Clip) {
+        // The projection of a point behind the camera is meaningless, so
+        // tell the facing in camera space: front faces have their normal
+        // towards the eye. Scaled to match the sign of the raster area.
+        math::Vec3f e1 = v1.cam - v0.cam, e2 = v2.cam - v0.cam;
+        area = -e1.cross_product(e2).dot_product(v0.cam);
+        if (area == 0 || !std::isfinite(area)) {
+            return result::Degenerate;
+        }
+    } else {
+        // Twice the signed area, y pointing down
+        const math::Vec3f &a = v0.raster, &b = v1.raster, &c = v2.raster;
+        area = (b.y - a.y) * (c.x - a.x) - (b.x - a.x) * (c.y - a.y);
+        if (!(std::fabs(area) >= 2 * min_area)) {
+            return result::Degenerate;
+        }
+    }
+    return area < 0 ? result::BackFacing : result::Visible;
+}
+
+// Call line(a, b) for each edge, in raster space, of the part of a
+// visible triangle in front of the camera: the triangle itself or, if any
+// vertex needs clipping, the polygon left after clipping it. The raster
+// projection of a point behind the camera is mirrored, so it is never
+// drawn to.
+template <typename Line>
+void outline(Camera &cam, const Vertex &v0, const Vertex &v1,
+             const Vertex &v2, Line &&line) {
+    if (!((v0.outcode | v1.outcode | v2.outcode) & clipping::Clip)) {
+        line(v0.raster, v1.raster);
+        line(v1.raster, v2.raster);
+        line(v2.raster, v0.raster);
+        return;
+    }
+    clipping::Vertex poly[clipping::max_vertices];
+    uint32_t n = clipping::clip_triangle(cam, v0.cam, v1.cam, v2.cam, poly);
+    math::Vec3f raster[clipping::max_vertices];
+    for (uint32_t i = 0; i < n; i++) {
+        cam.project_to_raster(poly[i].cam, raster[i]);
+    }
+    for (uint32_t i = 0; n >= 3 && i < n; i++) {
+        line(raster[i], raster[(i + 1) % n]);
+    }
+}
+
+namespace detail {
+// Project every vertex, then classify triangles 0 to n - 1, whose vertex
+// indices index(i, k) returns. The projection is independent per vertex, so
+// it runs in parallel; the classification is cheap and keeps the order.
+template <typename Index>
+uint32_t cull(Camera &cam, const math::Vec3f *vertices, uint32_t num_vertices,
+              uint32_t n, Index &&index, std::vector<Vertex> &projected,
+              std::vector<uint32_t> &visible, bool cull_back_faces) {
+    const auto n_vertices = static_cast<int>(num_vertices);
+    projected.resize(num_vertices);
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < n_vertices; i++) {
+        project(cam, vertices[i], projected[i]);
+    }
+    const size_t start = visible.size();
+    for (uint32_t i = 0; i < n; i++) {
+        result r = classify(projected[index(i, 0)], projected[index(i, 1)],
+                            projected[index(i, 2)]);
+        if (r == result::Visible ||
+            (r == result::BackFacing && !cull_back_faces)) {
+            visible.push_back(i);
+        }
+    }
+    return static_cast<uint32_t>(visible.size() - start);
+}
+} // namespace detail
+
+// Project vertices[0, num_vertices) into projected, and append to visible
+// the index of each triangle, every three indices making one, which is
+// neither off screen nor degenerate, nor back facing if cull_back_faces is
+// set. Returns the number of triangles appended. Throws std::out_of_range,
+// appending nothing, if an index is out of range.
+inline uint32_t cull_mesh(Camera &cam, const math::Vec3f *vertices,
+                          uint32_t num_vertices, const uint32_t *indices,
+                          uint32_t num_indices, std::vector<Vertex> &projected,
+                          std::vector<uint32_t> &visible,
+                          bool cull_back_faces = true) {
+    for (uint32_t i = 0; i < num_indices; i++) {
+        if (indices[i] >= num_vertices) {
+            throw std::out_of_range("Vertex index out of range");
+        }
+    }
+    return detail::cull(
+        cam, vertices, num_vertices, num_indices / 3,
+        [&](uint32_t i, uint32_t k) { return indices[3 * i + k]; },
+        projected, visible, cull_back_faces);
+}
+
+// The same for a triangle soup, every three vertices making a triangle
+inline uint32_t cull_mesh(Camera &cam, const math::Vec3f *vertices,
+                          uint32_t num_vertices,
+                          std::vector<Vertex> &projected,
+                          std::vector<uint32_t> &visible,
+                          bool cull_back_faces = true) {
+    return detail::cull(
+        cam, vertices, num_vertices, num_vertices / 3,
+        [](uint32_t i, uint32_t k) { return 3 * i + k; }, projected, visible,
+        cull_back_faces);
+}
+
+} // namespace culling
+} // namespace alpha
+
+#endif
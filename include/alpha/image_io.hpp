@@ -0,0 +1,463 @@
+//===---- image_io -------- Bulk image file output --------------*- C++ -*-===//
+//
+// Alpha-trace -> Minimal C++ raytracer
+//
+// Written by: Shikhar Bhardwaj | shikhar@bluefog.me
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Writing binary images, such as PPM, a header followed by fixed size rows.
+/// Rows are converted into large contiguous chunks, in parallel, and each
+/// chunk is written with one call. On POSIX systems a file can instead be
+/// mapped, and the rows converted straight into it. Images can also be
+/// compressed losslessly as QOI, in strips encoded in parallel.
+///
+//===----------------------------------------------------------------------===//
+#ifndef ALPHA_IMAGE_IO
+#define ALPHA_IMAGE_IO
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ALPHA_POSIX_IO
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace alpha {
+namespace io {
+
+enum class write_mode : uint8_t {
+    // Convert a chunk of rows into a buffer, then write it
+    Buffered,
+    // Map the file and convert the rows into it. Buffered where files
+    // cannot be mapped.
+    Mapped
+};
+
+// Bytes of rows converted before each write
+constexpr size_t chunk_bytes = size_t(4) << 20;
+
+// The header of a binary PPM, as the buffers have always written it
+inline std::string ppm_header(uint32_t width, uint32_t height,
+                              uint32_t max_value = 255) {
+    return "P6 " + std::to_string(width) + " " + std::to_string(height) + " " +
+           std::to_string(max_value) + " ";
+}
+
+// The header of a PAM image of RGBA bytes, padded with a comment to a
+// multiple of align bytes, so that the pixels after it can be aligned
+inline std::string pam_header(uint32_t width, uint32_t height,
+                              size_t align = 64) {
+    std::string head = "P7\nWIDTH " + std::to_string(width) + "\nHEIGHT " +
+                       std::to_string(height) +
+                       "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\n";
+    const std::string end = "ENDHDR\n";
+    size_t pad = (align - (head.size() + end.size() + 2) % align) % align;
+    return head + "#" + std::string(pad, ' ') + "\n" + end;
+}
+
+inline int default_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+namespace detail {
+// Convert rows [y0, y1) to out, row_bytes apart
+template <typename Convert>
+void convert_rows(uint32_t y0, uint32_t y1, size_t row_bytes, uint8_t *out,
+                  Convert &convert, int num_threads) {
+    const auto n = static_cast<int>(y1 - y0);
+#pragma omp parallel for schedule(static) num_threads(num_threads) \
+    if (num_threads > 1 && n > 1)
+    for (int i = 0; i < n; i++) {
+        convert(y0 + uint32_t(i), out + size_t(i) * row_bytes);
+    }
+}
+
+inline uint32_t rows_per_chunk(uint32_t height, size_t row_bytes) {
+    size_t rows = std::max<size_t>(1, chunk_bytes / std::max<size_t>(
+                                                        1, row_bytes));
+    return uint32_t(std::min<size_t>(rows, height));
+}
+
+#ifdef ALPHA_POSIX_IO
+[[noreturn]] inline void fail(const std::string &what,
+                              const std::string &name) {
+    throw std::runtime_error(what + " " + name + ": " + std::strerror(errno));
+}
+
+// Write all of iov, retrying partial and interrupted writes
+inline void write_all(int fd, struct iovec *iov, int n,
+                      const std::string &name) {
+    while (n > 0) {
+        ssize_t done = ::writev(fd, iov, n);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("Cannot write", name);
+        }
+        auto left = static_cast<size_t>(done);
+        while (n > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+}
+#endif
+} // namespace detail
+
+#ifdef ALPHA_POSIX_IO
+// A file of a fixed size, mapped read-write and shared, so that stores to
+// data() become the file's contents. sync() writes them back; unmapping
+// on destruction does so lazily.
+class mapped_file {
+    int fd = -1;
+    uint8_t *map = nullptr;
+    size_t length = 0;
+
+  public:
+    mapped_file() = delete;
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    // Creates or truncates name to size bytes
+    mapped_file(const std::string &name, size_t size) : length(size) {
+        fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            detail::fail("Cannot open", name);
+        }
+        if (::ftruncate(fd, static_cast<off_t>(size)) != 0 ||
+            (size > 0 && (map = static_cast<uint8_t *>(
+                              ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, fd, 0))) == MAP_FAILED)) {
+            map = nullptr;
+            ::close(fd);
+            detail::fail("Cannot map", name);
+        }
+    }
+
+    ~mapped_file() {
+        if (map) {
+            ::munmap(map, length);
+        }
+        ::close(fd);
+    }
+
+    uint8_t *data() { return map; }
+    size_t size() const { return length; }
+
+    // Start writing the mapped pages back; with wait, return once they
+    // are on disk. Other readers of the file see the stores either way.
+    void sync(bool wait = true) {
+        if (map && ::msync(map, length, wait ? MS_SYNC : MS_ASYNC) != 0) {
+            throw std::runtime_error(std::string("Cannot sync mapping: ") +
+                                     std::strerror(errno));
+        }
+    }
+};
+#endif
+
+// Write header, then rows 0 to height - 1 of row_bytes bytes each, which
+// convert(y, out) stores to out.
+template <typename Convert>
+void write_image(std::ostream &out, const std::string &header,
+                 uint32_t height, size_t row_bytes, Convert &&convert,
+                 int num_threads = default_threads()) {
+    out.write(header.data(), std::streamsize(header.size()));
+    const uint32_t rows = detail::rows_per_chunk(height, row_bytes);
+    std::vector<uint8_t> chunk(rows * row_bytes);
+    for (uint32_t y = 0; y < height; y += rows) {
+        uint32_t y1 = std::min(height, y + rows);
+        detail::convert_rows(y, y1, row_bytes, chunk.data(), convert,
+                             num_threads);
+        out.write(reinterpret_cast<const char *>(chunk.data()),
+                  std::streamsize((y1 - y) * row_bytes));
+    }
+}
+
+// The same to the file name, which is created or truncated. Throws
+// std::runtime_error if it cannot be written.
+template <typename Convert>
+void write_image(const std::string &name, const std::string &header,
+                 uint32_t height, size_t row_bytes, Convert &&convert,
+                 write_mode mode = write_mode::Buffered,
+                 int num_threads = default_threads()) {
+#ifdef ALPHA_POSIX_IO
+    if (mode == write_mode::Mapped) {
+        mapped_file file(name, header.size() + height * row_bytes);
+        std::memcpy(file.data(), header.data(), header.size());
+        detail::convert_rows(0, height, row_bytes,
+                             file.data() + header.size(), convert,
+                             num_threads);
+        return;
+    }
+    int fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        detail::fail("Cannot open", name);
+    }
+    const uint32_t rows = detail::rows_per_chunk(height, row_bytes);
+    std::vector<uint8_t> chunk(rows * row_bytes);
+    try {
+        // The header goes out with the first chunk
+        bool first = true;
+        uint32_t y = 0;
+        do {
+            uint32_t y1 = std::min(height, y + rows);
+            detail::convert_rows(y, y1, row_bytes, chunk.data(), convert,
+                                 num_threads);
+            struct iovec iov[2] = {
+                {const_cast<char *>(header.data()), header.size()},
+                {chunk.data(), (y1 - y) * row_bytes}};
+            detail::write_all(fd, first ? iov : iov + 1, first ? 2 : 1, name);
+            first = false;
+            y = y1;
+        } while (y < height);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    if (::close(fd) != 0) {
+        detail::fail("Cannot write", name);
+    }
+#else
+    (void)mode;
+    std::ofstream file(name, std::fstream::binary);
+    if (!file) {
+        throw std::runtime_error("Cannot open " + name);
+    }
+    write_image(file, header, height, row_bytes, convert, num_threads);
+    if (!file.flush()) {
+        throw std::runtime_error("Cannot write " + name);
+    }
+#endif
+}
+
+// QOI, the "Quite OK Image" format: lossless, and encoded in one pass
+// with no entropy coder. Each pixel is a run of the previous one, an entry
+// of an index of recently seen pixels, a small difference from the
+// previous pixel, or stored whole.
+namespace qoi {
+
+// Pixels as r | g << 8 | b << 16 | a << 24. Unseen index entries are 0.
+inline uint32_t pack(const uint8_t *rgb) {
+    return rgb[0] | uint32_t(rgb[1]) << 8 | uint32_t(rgb[2]) << 16 |
+           uint32_t(255) << 24;
+}
+
+inline uint32_t hash(uint32_t p) {
+    return ((p & 0xff) * 3 + (p >> 8 & 0xff) * 5 + (p >> 16 & 0xff) * 7 +
+            (p >> 24) * 11) % 64;
+}
+
+// What a decoder knows before a pixel: the previous pixel, and the last
+// pixel decoded with each hash.
+struct state {
+    uint32_t prev = uint32_t(255) << 24;
+    uint32_t index[64] = {};
+};
+
+// The index entries, and last pixel, that RGB pixels px[0, n) leave
+struct strip_summary {
+    uint64_t seen = 0;
+    uint32_t last = 0;
+    uint32_t index[64];
+};
+
+inline strip_summary summarise(const uint8_t *px, size_t n) {
+    strip_summary sum;
+    if (n > 0) {
+        sum.last = pack(px + 3 * (n - 1));
+    }
+    // Backwards, so that most strips stop once every entry is known
+    for (size_t i = n; i-- > 0 && sum.seen != ~uint64_t(0);) {
+        uint32_t p = pack(px + 3 * i);
+        uint32_t h = hash(p);
+        if (!(sum.seen >> h & 1)) {
+            sum.seen |= uint64_t(1) << h;
+            sum.index[h] = p;
+        }
+    }
+    return sum;
+}
+
+// The state after s and then the strip summarised by sum
+inline void advance(state &s, const strip_summary &sum) {
+    if (sum.seen == 0) {
+        return;
+    }
+    for (int h = 0; h < 64; ++h) {
+        if (sum.seen >> h & 1) {
+            s.index[h] = sum.index[h];
+        }
+    }
+    s.prev = sum.last;
+}
+
+// Encode RGB pixels px[0, n) to out, which has room for 4 * n bytes, from
+// state s. Returns the end of the output. A run in progress is ended at
+// the last pixel, so that strips encoded apart from the same states can be
+// concatenated.
+inline uint8_t *encode(const uint8_t *px, size_t n, state s, uint8_t *out) {
+    uint32_t run = 0, prev = s.prev;
+    for (size_t i = 0; i < n; ++i, px += 3) {
+        uint32_t p = pack(px);
+        if (p == prev) {
+            if (++run == 62) {
+                *out++ = uint8_t(0xc0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *out++ = uint8_t(0xc0 | (run - 1));
+            run = 0;
+        }
+        uint32_t h = hash(p);
+        if (s.index[h] == p) {
+            *out++ = uint8_t(h);
+        } else {
+            s.index[h] = p;
+            // Differences wrap around, as the decoder's sums do
+            auto dr = int8_t(px[0] - (prev & 0xff));
+            auto dg = int8_t(px[1] - (prev >> 8 & 0xff));
+            auto db = int8_t(px[2] - (prev >> 16 & 0xff));
+            auto dr_dg = int8_t(dr - dg), db_dg = int8_t(db - dg);
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+                db <= 1) {
+                *out++ = uint8_t(0x40 | (dr + 2) << 4 | (dg + 2) << 2 |
+                                 (db + 2));
+            } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+                       db_dg >= -8 && db_dg <= 7) {
+                *out++ = uint8_t(0x80 | (dg + 32));
+                *out++ = uint8_t((dr_dg + 8) << 4 | (db_dg + 8));
+            } else {
+                *out++ = 0xfe;
+                *out++ = px[0];
+                *out++ = px[1];
+                *out++ = px[2];
+            }
+        }
+        prev = p;
+    }
+    if (run > 0) {
+        *out++ = uint8_t(0xc0 | (run - 1));
+    }
+    return out;
+}
+
+inline void put_u32(uint8_t *out, uint32_t v) {
+    out[0] = uint8_t(v >> 24);
+    out[1] = uint8_t(v >> 16);
+    out[2] = uint8_t(v >> 8);
+    out[3] = uint8_t(v);
+}
+
+} // namespace qoi
+
+// Write an opaque width x height QOI image, whose row y convert(y, out)
+// stores to out as RGB bytes. Each chunk of rows is split into a strip per
+// thread, encoded in parallel: a first pass finds the state a decoder is
+// in at the start of each strip, so that the strips join into one stream.
+template <typename Convert>
+void write_qoi(std::ostream &out, uint32_t width, uint32_t height,
+               Convert &&convert, int num_threads = default_threads()) {
+    uint8_t header[14] = {'q', 'o', 'i', 'f'};
+    qoi::put_u32(header + 4, width);
+    qoi::put_u32(header + 8, height);
+    header[12] = 3;
+    header[13] = 0;
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+    const size_t row_bytes = size_t(3) * width;
+    const auto strips = uint32_t(std::max(1, num_threads));
+    const uint32_t rows = std::min(
+        height, detail::rows_per_chunk(height, row_bytes) * strips);
+    std::vector<uint8_t> chunk(rows * row_bytes);
+    std::vector<std::vector<uint8_t>> encoded(strips);
+    std::vector<uint32_t> encoded_size(strips);
+    std::vector<qoi::state> start(strips);
+    std::vector<qoi::strip_summary> sums(strips);
+    qoi::state s;
+    for (uint32_t y = 0; y < height; y += rows) {
+        const uint32_t y1 = std::min(height, y + rows);
+        detail::convert_rows(y, y1, row_bytes, chunk.data(), convert,
+                             num_threads);
+        // Strip i is rows [y + first(i), y + first(i + 1))
+        auto first = [&](uint32_t i) { return (y1 - y) * i / strips; };
+        const auto n = static_cast<int>(strips);
+#pragma omp parallel num_threads(num_threads) if (n > 1)
+        {
+#pragma omp for schedule(static)
+            for (int i = 0; i < n; i++) {
+                sums[i] = qoi::summarise(chunk.data() + first(i) * row_bytes,
+                                         (first(i + 1) - first(i)) * width);
+            }
+#pragma omp single
+            for (uint32_t i = 0; i < strips; i++) {
+                start[i] = s;
+                qoi::advance(s, sums[i]);
+            }
+#pragma omp for schedule(static)
+            for (int i = 0; i < n; i++) {
+                size_t pixels = size_t(first(i + 1) - first(i)) * width;
+                encoded[i].resize(4 * pixels);
+                uint8_t *end = qoi::encode(
+                    chunk.data() + first(i) * row_bytes, pixels, start[i],
+                    encoded[i].data());
+                encoded_size[i] = uint32_t(end - encoded[i].data());
+            }
+        }
+        for (uint32_t i = 0; i < strips; i++) {
+            out.write(reinterpret_cast<const char *>(encoded[i].data()),
+                      std::streamsize(encoded_size[i]));
+        }
+    }
+    const char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    out.write(end, sizeof(end));
+}
+
+// The same to the file name, which is created or truncated. Throws
+// std::runtime_error if it cannot be written.
+template <typename Convert>
+void write_qoi(const std::string &name, uint32_t width, uint32_t height,
+               Convert &&convert, int num_threads = default_threads()) {
+    std::ofstream file(name, std::fstream::binary);
+    if (!file) {
+        throw std::runtime_error("Cannot open " + name);
+    }
+    write_qoi(file, width, height, convert, num_threads);
+    if (!file.flush()) {
+        throw std::runtime_error("Cannot write " + name);
+    }
+}
+
+} // namespace io
+} // namespace alpha
+
+#endif
@@ -14,7 +14,7 @@
 #define ALPHA_MESH_RENDERER
 
 #include <alpha/camera.hpp>
-#include <alpha/rasteriser.hpp>
+#include <alpha/culling.hpp>
 #include <alpha/svg.hpp>
 #include <alpha/vertex_import.hpp>
 
@@ -28,9 +28,6 @@ namespace alpha {
         // Camera
         std::shared_ptr<alpha::Camera> _cam_inst = std::make_shared<alpha::Camera>(_camera_file);
 
-        // Rasteriser
-        alpha::Rasteriser<> _rast = alpha::Rasteriser<>(_cam_inst);
-
         // SVG Export
         std::unique_ptr<alpha::SVG_export> _exporter = std::make_unique<alpha::SVG_export>(
             _cam_inst->img_width, _cam_inst->img_height, _output_file);
@@ -45,21 +42,27 @@ namespace alpha {
             _mesh_data_file(mesh_data_file), _camera_file(camera_file),
             _output_file(output_file), _cull_back_faces(cull_back_faces) {}
 
-        void render() {
-            for (uint32_t i = 0; i < _data.num_triangles; ++i) {
-                const auto& v0 = _data.vertices[3 * i];
-                const auto& v1 = _data.vertices[3 * i + 1];
-                const auto& v2 = _data.vertices[3 * i + 2];
+        // Culling state, reused between renders
+        std::vector<alpha::culling::Vertex> _projected;
+        std::vector<uint32_t> _visible;
 
-                if (!_cull_back_faces || _rast.draw_triangle(v0, v1, v2)) {
-                    alpha::math::Vec3f v0_rast, v1_rast, v2_rast;
-                    _cam_inst->convert_to_raster(v0, v0_rast);
-                    _cam_inst->convert_to_raster(v1, v1_rast);
-                    _cam_inst->convert_to_raster(v2, v2_rast);
-                    _exporter->put_line(v0_rast, v1_rast);
-                    _exporter->put_line(v1_rast, v2_rast);
-                    _exporter->put_line(v2_rast, v0_rast);
-                }
+        // Every triangle which is on screen, and front facing if back faces
+        // are culled, is exported. Vertices are projected once, and nothing
+        // is rasterised. Triangles crossing the near plane are clipped to
+        // it, and their visible part exported.
+        void render() {
+            _visible.clear();
+            alpha::culling::cull_mesh(*_cam_inst, _data.vertices.data(),
+                                      3 * _data.num_triangles, _projected,
+                                      _visible, _cull_back_faces);
+            for (auto i : _visible) {
+                alpha::culling::outline(
+                    *_cam_inst, _projected[3 * i], _projected[3 * i + 1],
+                    _projected[3 * i + 2],
+                    [&](const alpha::math::Vec3f &a,
+                        const alpha::math::Vec3f &b) {
+                        _exporter->put_line(a, b);
+                    });
             }
         }
     };
@@ -16,10 +16,22 @@
 #include <fstream>
 #include <memory>
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "math.hpp"
 #include "buffers.hpp"
 #include "camera.hpp"
+#include "clipping.hpp"
+#include "simd.hpp"
 
 namespace alpha {
 namespace shaders {
@@ -38,234 +50,1781 @@ struct do_nothing {
         return RGB(0, 0, 0);
     }
 };
+
+// Pixels in a packet
+constexpr uint32_t packet_size = 64;
+
+// The triangle the pixels of a packet belong to
+struct triangle_context {
+    math::Vec3f v0_cam, v1_cam, v2_cam;
+    uint32_t id;
+};
+
+// Covered pixels of one triangle, as a structure of arrays. Instead of being
+// called per pixel, a shader may take whole packets:
+//
+//     void operator()(const shaders::pixel_packet &p, RGB *colours);
+//
+// setting colours[i] for every i < p.count.
+struct pixel_packet {
+    triangle_context triangle;
+    uint32_t count;
+    float b0[packet_size], b1[packet_size], b2[packet_size], z[packet_size];
+    uint32_t x[packet_size], y[packet_size];
+};
 }
-template<typename Shader = shaders::do_nothing>
+namespace detail {
+// Shaders may take the triangle id as a trailing argument. This is needed
+// whenever shading is deferred (as in the binned mode), since the caller can
+// no longer track which triangle is being shaded.
+template <typename Shader, typename = void>
+struct takes_triangle_id : std::false_type {};
+
+template <typename Shader>
+struct takes_triangle_id<Shader, decltype(void(std::declval<Shader &>()(
+        0.f, 0.f, 0.f, 0.f, std::declval<math::Vec3f>(),
+        std::declval<math::Vec3f>(), std::declval<math::Vec3f>(),
+        uint32_t(0))))> : std::true_type {};
+
+template <typename Shader, typename = void>
+struct shades_packets : std::false_type {};
+
+template <typename Shader>
+struct shades_packets<Shader, decltype(void(std::declval<Shader &>()(
+        std::declval<const shaders::pixel_packet &>(),
+        std::declval<buffers::RGB *>())))> : std::true_type {};
+
+// Per pixel shaders may return any Vec3, whose components are narrowed to
+// bytes like Imagebuffer::set does.
+template <typename Colour>
+buffers::RGB to_rgb(const Colour &c) {
+    return buffers::RGB(c.x, c.y, c.z);
+}
+
+// Shaders may hoist work which is the same for every pixel of a triangle
+// into a setup step, run once per triangle:
+//
+//     Interpolants setup(Vec3f v0_cam, Vec3f v1_cam, Vec3f v2_cam,
+//                        uint32_t id);
+//     RGB operator()(float b0, float b1, float b2, float z,
+//                    const Interpolants &);
+//
+// Interpolants can be any copyable type. Shaders without setup get
+// no_interpolants, which is ignored.
+struct no_interpolants {};
+
+template <typename Shader, typename = void>
+struct has_setup : std::false_type {
+    using type = no_interpolants;
+};
+
+template <typename Shader>
+struct has_setup<Shader, decltype(void(std::declval<Shader &>().setup(
+        std::declval<math::Vec3f>(), std::declval<math::Vec3f>(),
+        std::declval<math::Vec3f>(), uint32_t(0))))> : std::true_type {
+    using type = decltype(std::declval<Shader &>().setup(
+            std::declval<math::Vec3f>(), std::declval<math::Vec3f>(),
+            std::declval<math::Vec3f>(), uint32_t(0)));
+};
+
+template <typename Shader>
+using interpolants_t = typename has_setup<Shader>::type;
+
+template <typename Shader>
+interpolants_t<Shader> setup(Shader &shader, const math::Vec3f &v0_cam,
+                             const math::Vec3f &v1_cam,
+                             const math::Vec3f &v2_cam, uint32_t id,
+                             std::true_type) {
+    return shader.setup(v0_cam, v1_cam, v2_cam, id);
+}
+
+template <typename Shader>
+no_interpolants setup(Shader &, const math::Vec3f &, const math::Vec3f &,
+                      const math::Vec3f &, uint32_t, std::false_type) {
+    return no_interpolants();
+}
+
+// The interface a shader is called through, in order of preference
+enum class shader_kind { Packet, Setup, TriangleId, Plain };
+
+template <typename Shader>
+using kind_of = std::integral_constant<shader_kind,
+        shades_packets<Shader>::value ? shader_kind::Packet :
+        has_setup<Shader>::value ? shader_kind::Setup :
+        takes_triangle_id<Shader>::value ? shader_kind::TriangleId :
+        shader_kind::Plain>;
+
+template <shader_kind K>
+using kind = std::integral_constant<shader_kind, K>;
+
+template <typename Shader, typename Interpolants>
+void shade_packet(Shader &shader, const shaders::pixel_packet &p,
+                  const Interpolants &, buffers::RGB *colours,
+                  kind<shader_kind::Packet>) {
+    shader(p, colours);
+}
+
+template <typename Shader, typename Interpolants>
+void shade_packet(Shader &shader, const shaders::pixel_packet &p,
+                  const Interpolants &interp, buffers::RGB *colours,
+                  kind<shader_kind::Setup>) {
+    for (uint32_t i = 0; i < p.count; i++) {
+        colours[i] = to_rgb(shader(p.b0[i], p.b1[i], p.b2[i], p.z[i],
+                                   interp));
+    }
+}
+
+template <typename Shader, typename Interpolants>
+void shade_packet(Shader &shader, const shaders::pixel_packet &p,
+                  const Interpolants &, buffers::RGB *colours,
+                  kind<shader_kind::TriangleId>) {
+    const shaders::triangle_context &t = p.triangle;
+    for (uint32_t i = 0; i < p.count; i++) {
+        colours[i] = to_rgb(shader(p.b0[i], p.b1[i], p.b2[i], p.z[i],
+                                   t.v0_cam, t.v1_cam, t.v2_cam, t.id));
+    }
+}
+
+template <typename Shader, typename Interpolants>
+void shade_packet(Shader &shader, const shaders::pixel_packet &p,
+                  const Interpolants &, buffers::RGB *colours,
+                  kind<shader_kind::Plain>) {
+    const shaders::triangle_context &t = p.triangle;
+    for (uint32_t i = 0; i < p.count; i++) {
+        colours[i] = to_rgb(shader(p.b0[i], p.b1[i], p.b2[i], p.z[i],
+                                   t.v0_cam, t.v1_cam, t.v2_cam));
+    }
+}
+}
+
+namespace shaders {
+// Shade a packet, calling shaders without a packet interface once per pixel.
+// interp is the result of shader.setup() for the packet's triangle, for
+// shaders which have it.
+template <typename Shader>
+void shade_packet(Shader &shader, const pixel_packet &p,
+                  const detail::interpolants_t<Shader> &interp,
+                  buffers::RGB *colours) {
+    detail::shade_packet(shader, p, interp, colours,
+                         detail::kind_of<Shader>());
+}
+
+template <typename Shader>
+void shade_packet(Shader &shader, const pixel_packet &p,
+                  buffers::RGB *colours) {
+    static_assert(!detail::has_setup<Shader>::value,
+                  "Shaders with setup need its interpolants");
+    shade_packet(shader, p, detail::no_interpolants(), colours);
+}
+}
+
+// Immediate rasterises and shades each triangle as it is drawn. Binned
+// queues triangles per screen tile, to be rasterised in parallel by flush().
+// Deferred bins like Binned, but resolves visibility for a whole tile before
+// shading it, so the shader runs at most once per pixel. Composited queues
+// triangles unbinned; flush() splits them between the threads, which each
+// draw into buffers of their own, and merges the buffers by depth. It suits
+// many small triangles spread evenly over the screen.
+//
+// Every mode produces the same Imagebuffer and Zbuffer contents, bit for bit
+// and whatever the number of threads: each pixel sees the triangles covering
+// it in submission order, so depth ties go to the first triangle drawn.
+enum class raster_mode {
+    Immediate = 0, Binned, Deferred, Composited
+};
+
+// Which triangles setup discards. Front faces wind counter-clockwise on
+// screen.
+enum class cull_mode {
+    None = 0, Back, Front
+};
+
+// The fixed function state of the pipeline. It is a template parameter of
+// the Rasteriser, so every combination compiles to inner loops of its own
+// with no tests of the state left in them.
+//
+// Without depth_test every covered pixel passes, in submission order;
+// without depth_write the Zbuffer is only read. Without colour_write
+// nothing is shaded and the Imagebuffer is never touched after it is
+// allocated. Without perspective_correct depth is interpolated linearly in
+// screen space, saving a division per pixel; the barycentrics passed to
+// shaders are screen space either way.
+template <bool DepthTest = true, bool DepthWrite = true,
+          bool ColourWrite = true, cull_mode Cull = cull_mode::Back,
+          bool PerspectiveCorrect = true>
+struct pipeline_state {
+    static constexpr bool depth_test = DepthTest;
+    static constexpr bool depth_write = DepthWrite;
+    static constexpr bool colour_write = ColourWrite;
+    static constexpr cull_mode cull = Cull;
+    static constexpr bool perspective_correct = PerspectiveCorrect;
+};
+
+// Opaque geometry, the default
+using opaque_state = pipeline_state<>;
+// Depth only, as for shadow maps and depth pre-passes
+using depth_only_state = pipeline_state<true, true, false>;
+// Double sided geometry drawn over everything in submission order, as for
+// overlays
+using overlay_state =
+        pipeline_state<false, false, true, cull_mode::None>;
+
+// What an occlusion query counts: every sample passing the depth test, or
+// only whether any does, which stops testing at the first one.
+enum class occlusion_query {
+    Samples = 0, AnySamples
+};
+
+// Side of the square screen tiles used for binning.
+constexpr uint32_t tile_size = 64;
+
+// Side of the square blocks a tile is classified in before testing pixels.
+constexpr uint32_t block_size = 8;
+static_assert(tile_size % block_size == 0 && block_size % simd::width == 0,
+              "Blocks must split tiles and vector groups evenly");
+static_assert(block_size == buffers::hiz_block_size &&
+              tile_size == block_size * buffers::hiz_tile_blocks,
+              "Blocks and tiles must match the Zbuffer's depth bounds");
+
+// Triangles whose bounding box spans at most small_size pixels each way skip
+// the block walk, and have every pixel of that footprint tested at once.
+constexpr uint32_t small_size = 4;
+constexpr uint32_t small_pixels = small_size * small_size;
+static_assert(small_pixels % simd::width == 0,
+              "Small footprints must split into vector groups evenly");
+
+// Counters for the work done in rasterisation. Only collected when
+// ALPHA_RASTER_STATS is defined.
+struct raster_stats {
+    // Pixels a walk over the bounding boxes would have tested
+    std::atomic<uint64_t> pixels_in_bounds{0};
+    // Pixels whose edge functions were actually tested
+    std::atomic<uint64_t> pixels_tested{0};
+    std::atomic<uint64_t> blocks_accepted{0};
+    std::atomic<uint64_t> blocks_rejected{0};
+    std::atomic<uint64_t> blocks_partial{0};
+    // Work skipped because the Zbuffer was already nearer
+    std::atomic<uint64_t> tiles_occluded{0};
+    std::atomic<uint64_t> blocks_occluded{0};
+    // Tiles of small triangles, which skip the block walk
+    std::atomic<uint64_t> small_footprints{0};
+
+    raster_stats() = default;
+
+    raster_stats(const raster_stats &other) { *this = other; }
+
+    raster_stats &operator=(const raster_stats &other) {
+        pixels_in_bounds = other.pixels_in_bounds.load();
+        pixels_tested = other.pixels_tested.load();
+        blocks_accepted = other.blocks_accepted.load();
+        blocks_rejected = other.blocks_rejected.load();
+        blocks_partial = other.blocks_partial.load();
+        tiles_occluded = other.tiles_occluded.load();
+        blocks_occluded = other.blocks_occluded.load();
+        small_footprints = other.small_footprints.load();
+        return *this;
+    }
+
+    void reset() { *this = raster_stats(); }
+};
+
+// Raster positions are snapped to 28.4 fixed point before rasterisation, so
+// coverage is decided with exact integer arithmetic.
+constexpr int subpixel_bits = 4;
+constexpr int64_t subpixel_scale = int64_t(1) << subpixel_bits;
+// Largest raster co-ordinate (in pixels) whose edge functions cannot overflow
+constexpr float max_raster_coord = float(1 << 24);
+
+// Snap a raster co-ordinate below max_raster_coord to the sub-pixel grid,
+// rounding halves away from zero like std::llround, which is a library
+// call. Every step is exact in double precision.
+inline int64_t snap_to_subpixel(float v) {
+    double d = double(v * subpixel_scale);
+    return int64_t(d < 0 ? d - 0.5 : d + 0.5);
+}
+
+// Depth is the format of the Zbuffer. The formats other than float_depth
+// compute their keys from the interpolated 1 / z, so with perspective
+// correct depth they test without dividing per pixel; shaders are still
+// passed the depth itself. Layout is the memory layout of both buffers;
+// tiled_layout keeps each screen tile contiguous. Colour is the format of
+// the Imagebuffer.
+template <typename Shader = shaders::do_nothing,
+          typename State = opaque_state,
+          typename Depth = buffers::float_depth,
+          typename Layout = buffers::linear_layout,
+          typename Colour = buffers::rgb8_colour>
 class Rasteriser {
     using Point = math::Vec3f;
     using RGB = alpha::buffers::RGB;
+    using Zbuffer = buffers::Depthbuffer<Depth, Layout>;
+    using Imagebuffer = buffers::Framebuffer<Colour, Layout>;
+    using ztype = typename Depth::type;
+
+    // Everything needed to rasterise a triangle, computed once at submission.
+    struct Triangle {
+        Point v0_cam, v1_cam, v2_cam;
+        // The raster z co-ordinates as interpolated across the screen: their
+        // multiplicative inverses for perspective correct depth, else
+        // themselves
+        float z0_lerp, z1_lerp, z2_lerp;
+        float total_area_inv;
+        // No pixel of the triangle has a nearer depth key than this
+        float near_key;
+        // Part of a clipped triangle: v*_cam are the vertices of the whole
+        // triangle, and remap turns barycentrics in the part into
+        // barycentrics in the whole
+        bool clipped;
+        float remap[3][3];
+        // Computed by the shader's setup step, if it has one
+        detail::interpolants_t<Shader> interp;
+        // Edge i is the one opposite vertex i. In sub-pixel units it is
+        // E_i(x, y) = a[i] * x + b[i] * y + c[i], positive inside the
+        // triangle. Pixels exactly on an edge are only covered if it is a
+        // top or left edge, which bias[i] (0 or -1) accounts for.
+        int64_t a[3], b[3], c[3], bias[3];
+        // Pixels whose centres lie in the bounding box
+        uint32_t x0, y0, x1, y1;
+        uint32_t id;
+        // The bounding box, before clamping to the screen, fits in
+        // small_size x small_size pixels
+        bool small;
+
+        bool empty() const { return x0 > x1 || y0 > y1; }
+
+        // Edge i at the centre of pixel (x, y)
+        int64_t edge(int i, int64_t x, int64_t y) const {
+            return a[i] * (x * subpixel_scale + subpixel_scale / 2) +
+                   b[i] * (y * subpixel_scale + subpixel_scale / 2) + c[i];
+        }
+    };
+
+    raster_mode mode;
+    int num_threads;
+    uint32_t tiles_x, tiles_y;
+    uint32_t next_id = 0;
+    // Binned and deferred mode state: triangles in submission order and, per
+    // tile, the indices of the triangles overlapping it (also in submission
+    // order).
+    std::vector<Triangle> triangles;
+    std::vector<std::vector<uint32_t>> bins;
+    // Visibility buffer entry for the deferred mode: the nearest triangle
+    // at a pixel, and its barycentrics and depth there. The Zbuffer only
+    // keeps the depth to the precision of its format.
+    struct Visible {
+        uint32_t triangle;
+        float b0, b1, b2, z;
+    };
+    static constexpr uint32_t no_triangle = 0xffffffff;
+    // Rotated grid sample positions for multisampling, in sub-pixels from
+    // the pixel centre, and how far they reach
+    static constexpr uint32_t msaa_samples = 4;
+    static constexpr int64_t msaa_radius = 6;
+    static constexpr int8_t msaa_offsets[msaa_samples][2] = {
+            {-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+    // A vertex after the vertex transform, with its outcode
+    struct Vertex {
+        Point cam, raster;
+        uint32_t outcode;
+    };
+    // Vertices transformed by draw_mesh and the triangles each thread set
+    // up from them, reused between calls
+    std::vector<Vertex> transformed;
+    std::vector<std::vector<Triangle>> geometry;
+    // Meshes with fewer triangles are set up on the calling thread
+    static constexpr int parallel_geometry_min = 1024;
+    // Composited mode state: a depth and colour buffer for every worker but
+    // the first, and the fewest triangles worth giving a worker
+    struct Layer {
+        std::unique_ptr<Zbuffer> Zbuf;
+        std::unique_ptr<Imagebuffer> Fbuf;
+    };
+    std::vector<Layer> layers;
+    static constexpr size_t composite_min = 256;
+    // Pixels waiting to be shaded in the immediate and multisampled paths,
+    // and the samples each multisampled pixel passed
+    shaders::pixel_packet packet;
+    uint32_t samples_passed[shaders::packet_size];
+    // Occlusion query state
+    bool querying = false;
+    occlusion_query query_kind = occlusion_query::Samples;
+    uint64_t query_samples = 0;
 
 public:
-    std::unique_ptr<buffers::Imagebuffer> Fbuf;
-    std::unique_ptr<buffers::Zbuffer> Zbuf;
+    std::unique_ptr<Imagebuffer> Fbuf;
+    std::unique_ptr<Zbuffer> Zbuf;
+    // Only allocated once a multisampled triangle is drawn
+    std::unique_ptr<buffers::Multisamplebuffer> MSbuf;
     std::shared_ptr<Camera> cam;
     Shader render_triangle;
     int width, height;
+    raster_stats stats;
 
     Rasteriser() = delete;
 
-    Rasteriser(std::shared_ptr<Camera> _cam_inst, Shader f = Shader()) {
+    Rasteriser(std::shared_ptr<Camera> _cam_inst, Shader f = Shader(),
+               raster_mode m = raster_mode::Immediate)
+        : mode(supported(m)) {
         cam = _cam_inst;
         render_triangle = std::move(f);
         width = cam->img_width;
         height = cam->img_height;
-        Fbuf = std::unique_ptr<buffers::Imagebuffer>(
-                new buffers::Imagebuffer(width, height));
-        Zbuf = std::unique_ptr<buffers::Zbuffer>(
-                new buffers::Zbuffer(width, height, cam->get_far_clipping_plain()));
+        Fbuf = std::unique_ptr<Imagebuffer>(
+                new Imagebuffer(width, height));
+        Zbuf = std::unique_ptr<Zbuffer>(
+                new Zbuffer(width, height, cam->get_far_clipping_plain(),
+                            cam->get_near_clipping_plain()));
+        tiles_x = (width + tile_size - 1) / tile_size;
+        tiles_y = (height + tile_size - 1) / tile_size;
+        bins.resize(tiles_x * tiles_y);
+#ifdef _OPENMP
+        num_threads = omp_get_max_threads();
+#else
+        num_threads = 1;
+#endif
+    }
+
+    // The deferred and composited modes find the visible triangle at each
+    // pixel from its depth, so without depth_test and depth_write they draw
+    // like the binned mode.
+    void set_mode(raster_mode m) {
+        flush();
+        mode = supported(m);
+    }
+
+    raster_mode get_mode() const { return mode; }
+
+    // Number of workers used to flush the bins.
+    void set_num_threads(int n) { num_threads = std::max(1, n); }
+
+    // Clear both buffers and start numbering triangles from zero again.
+    void clear() {
+        discard();
+        if (State::colour_write) {
+            Fbuf->clear();
+        }
+        Zbuf->clear();
+        if (MSbuf) {
+            MSbuf->clear();
+        }
+        next_id = 0;
+    }
+
+    // Start an occlusion query. Everything queued is drawn first. Until
+    // end_query(), draw_triangle and draw_mesh only depth test their
+    // triangles against Zbuf, and draw_triangle_4xMSAA against the samples
+    // of MSbuf, counting the samples which pass, and write neither colour
+    // nor depth. Once a sample passes an AnySamples query,
+    // the triangles after it are skipped.
+    void begin_query(occlusion_query kind = occlusion_query::Samples) {
+        flush();
+        querying = true;
+        query_kind = kind;
+        query_samples = 0;
+    }
+
+    // End the occlusion query, returning the number of samples that passed
+    // (for AnySamples, non-zero if any did).
+    uint64_t end_query() {
+        querying = false;
+        return query_samples;
+    }
+
+    void dump_as_ppm(const std::string &name,
+                     io::write_mode mode = io::write_mode::Buffered) {
+        flush();
+        Fbuf->dump_as_ppm(name, mode);
+    }
+
+    void dump_as_qoi(const std::string &name) {
+        flush();
+        Fbuf->dump_as_qoi(name);
+    }
+
+    // Render into the RGBA PAM image file name from now on, rather than a
+    // buffer dumped afterwards; see Framebuffer. Call sync_image() at the
+    // end of each frame.
+    void map_image(const std::string &name) {
+        flush();
+        Fbuf.reset(new Imagebuffer(name, width, height));
     }
 
-    void dump_as_ppm(const std::string &name) { Fbuf->dump_as_ppm(name); }
+    // Finish the frame and, when rendering into a file, write it out
+    void sync_image(bool wait = false) {
+        flush();
+        Fbuf->sync(wait);
+    }
 
-    void dump_zbuf(const std::string &name) { Zbuf->dump_as_ppm(name); }
+    void dump_zbuf(const std::string &name,
+                   io::write_mode mode = io::write_mode::Buffered) {
+        flush();
+        Zbuf->dump_as_ppm(name, mode);
+    }
 
+    // Returns false if the triangle is off screen or back facing. In the
+    // binned and deferred modes the triangle is only queued, call flush() to
+    // render it.
     bool draw_triangle(const Point &v0, const Point &v1, const Point &v2) {
-        // TODO : Optimize
-        Point v0_rast, v1_rast, v2_rast, v0_cam, v1_cam, v2_cam;
-        cam->convert_to_raster(v0, v0_rast, v0_cam);
-        cam->convert_to_raster(v1, v1_rast, v1_cam);
-        cam->convert_to_raster(v2, v2_rast, v2_cam);
+        if (query_answered()) {
+            next_id++;
+            return false;
+        }
+        Vertex a, b, c;
+        transform(v0, a);
+        transform(v1, b);
+        transform(v2, c);
+        return process_triangle(render_triangle, a, b, c, next_id++, 0,
+                                [&](const Triangle &t) { submit(t); });
+    }
+
+    // Draw an indexed triangle list, every three indices making a triangle.
+    // Each vertex is transformed once, however many triangles share it.
+    // Triangles are numbered in order, as if passed to draw_triangle one by
+    // one. Returns the number of triangles which are not culled. Throws
+    // std::out_of_range, drawing nothing, if an index is out of range.
+    //
+    // Large meshes go through the geometry stage in parallel: the vertices,
+    // then contiguous runs of triangles, are split between the threads,
+    // which set triangles up into a buffer each. The buffers are then
+    // submitted in order, so the result does not depend on the number of
+    // threads.
+    uint32_t draw_mesh(const Point *vertices, uint32_t num_vertices,
+                       const uint32_t *indices, uint32_t num_indices) {
+        const auto n_vertices = static_cast<int>(num_vertices);
+        const auto n_triangles = static_cast<int>(num_indices / 3);
+        if (query_answered()) {
+            next_id += n_triangles;
+            return 0;
+        }
+        // The post-transform vertex cache
+        transformed.resize(num_vertices);
+        geometry.resize(num_threads);
+        for (auto &buffer : geometry) {
+            buffer.clear();
+        }
+        uint32_t drawn = 0;
+        bool out_of_range = false;
+#pragma omp parallel num_threads(num_threads) \
+        if (n_triangles >= parallel_geometry_min)
+        {
+#pragma omp for schedule(static)
+            for (int i = 0; i < n_vertices; i++) {
+                transform(vertices[i], transformed[i]);
+            }
+            Shader shader = render_triangle;
+#ifdef _OPENMP
+            std::vector<Triangle> &buffer = geometry[omp_get_thread_num()];
+#else
+            std::vector<Triangle> &buffer = geometry[0];
+#endif
+            // Static scheduling hands each thread one run of triangles, in
+            // the order of the threads
+#pragma omp for schedule(static) reduction(+ : drawn) \
+        reduction(|| : out_of_range)
+            for (int i = 0; i < n_triangles; i++) {
+                uint32_t i0 = indices[3 * i], i1 = indices[3 * i + 1],
+                         i2 = indices[3 * i + 2];
+                if (i0 >= num_vertices || i1 >= num_vertices ||
+                    i2 >= num_vertices) {
+                    out_of_range = true;
+                    continue;
+                }
+                if (process_triangle(shader, transformed[i0], transformed[i1],
+                                     transformed[i2], next_id + i, 0,
+                                     [&](const Triangle &t) {
+                                         buffer.push_back(t);
+                                     })) {
+                    drawn++;
+                }
+            }
+        }
+        if (out_of_range) {
+            throw std::out_of_range("Vertex index out of range");
+        }
+        next_id += n_triangles;
+        // The raster stage
+        for (auto &buffer : geometry) {
+            for (auto &t : buffer) {
+                submit(t);
+            }
+        }
+        return drawn;
+    }
+
+    uint32_t draw_mesh(const std::vector<Point> &vertices,
+                       const std::vector<uint32_t> &indices) {
+        return draw_mesh(vertices.data(),
+                         static_cast<uint32_t>(vertices.size()),
+                         indices.data(), static_cast<uint32_t>(indices.size()));
+    }
+
+    // Render everything queued in the binned and deferred modes. Tiles are
+    // independent, so they are shaded in parallel; within a tile the
+    // triangles are drawn in submission order, which makes the output
+    // identical to the immediate mode. Each worker shades with its own copy
+    // of the shader.
+    void flush() {
+        if (triangles.empty()) {
+            return;
+        }
+        if (mode == raster_mode::Composited) {
+            flush_composited();
+            discard();
+            return;
+        }
+        std::vector<uint32_t> busy;
+        for (uint32_t i = 0; i < bins.size(); i++) {
+            if (!bins[i].empty()) {
+                busy.push_back(i);
+            }
+        }
+        auto n_busy = static_cast<int>(busy.size());
+#pragma omp parallel num_threads(num_threads)
+        {
+            Shader shader = render_triangle;
+            shaders::pixel_packet pixels;
+            std::vector<Visible> visible;
+            if (mode == raster_mode::Deferred) {
+                visible.resize(tile_size * tile_size);
+            }
+#pragma omp for schedule(dynamic, 1)
+            for (int i = 0; i < n_busy; i++) {
+                uint32_t tile = busy[i];
+                uint32_t tx = tile % tiles_x, ty = tile / tiles_x;
+                if (mode == raster_mode::Deferred) {
+                    shade_tile_deferred(shader, pixels, visible, tile);
+                    continue;
+                }
+                for (auto idx : bins[tile]) {
+                    draw_tile(shader, pixels, triangles[idx], tx, ty, *Zbuf,
+                              *Fbuf);
+                }
+            }
+        }
+        discard();
+    }
+
+    // Draw a triangle with 4x multisample anti-aliasing. Coverage and depth
+    // are tested at four samples per pixel, in MSbuf. The shader runs once
+    // per pixel, at its centre, and its colour is stored in every sample the
+    // triangle wins. Call resolve() to average the samples into Fbuf.
+    bool draw_triangle_4xMSAA(const Point &v0, const Point &v1,
+                              const Point &v2) {
+        flush();
+        if (query_answered()) {
+            next_id++;
+            return false;
+        }
+        if (!MSbuf) {
+            MSbuf = std::unique_ptr<buffers::Multisamplebuffer>(
+                    new buffers::Multisamplebuffer(
+                            width, height, msaa_samples,
+                            cam->get_far_clipping_plain()));
+        }
+        Vertex a, b, c;
+        transform(v0, a);
+        transform(v1, b);
+        transform(v2, c);
+        return process_triangle(render_triangle, a, b, c, next_id++,
+                                msaa_radius,
+                                [&](const Triangle &t) { rasterise_msaa(t); });
+    }
+
+    // Average the samples drawn with draw_triangle_4xMSAA into Fbuf,
+    // overwriting it.
+    void resolve() {
+        if (MSbuf && State::colour_write) {
+            MSbuf->resolve(*Fbuf);
+        }
+    }
+
+private:
+    // Walked in blocks like rasterise_tile. Sample offsets are bounded, so
+    // blocks with no sample inside an edge are skipped, and blocks with
+    // every sample inside all three cover each pixel without testing.
+    void rasterise_msaa(const Triangle &t) {
+        // Gradients of z*_lerp per sub-pixel, to step from the centre to
+        // samples
+        const float dzdx = (t.z0_lerp * t.a[0] + t.z1_lerp * t.a[1] +
+                            t.z2_lerp * t.a[2]) * t.total_area_inv;
+        const float dzdy = (t.z0_lerp * t.b[0] + t.z1_lerp * t.b[1] +
+                            t.z2_lerp * t.b[2]) * t.total_area_inv;
+        float sample_dz[msaa_samples];
+        // Each edge at the samples, less at the pixel centre, and its least
+        // and greatest such offset
+        int64_t sample_de[3][msaa_samples], de_lo[3], de_hi[3];
+        for (int i = 0; i < 3; i++) {
+            de_lo[i] = std::numeric_limits<int64_t>::max();
+            de_hi[i] = std::numeric_limits<int64_t>::min();
+        }
+        for (uint32_t s = 0; s < msaa_samples; s++) {
+            const int64_t sx = msaa_offsets[s][0];
+            const int64_t sy = msaa_offsets[s][1];
+            sample_dz[s] = dzdx * sx + dzdy * sy;
+            for (int i = 0; i < 3; i++) {
+                sample_de[i][s] = t.a[i] * sx + t.b[i] * sy + t.bias[i];
+                de_lo[i] = std::min(de_lo[i], sample_de[i][s]);
+                de_hi[i] = std::max(de_hi[i], sample_de[i][s]);
+            }
+        }
+        const uint32_t all = (1u << msaa_samples) - 1;
+        begin_packet(packet, t);
+        for (uint32_t by = t.y0 / block_size; by <= t.y1 / block_size; by++) {
+            uint32_t y0 = std::max(t.y0, by * block_size);
+            uint32_t y1 = std::min(t.y1, by * block_size + block_size - 1);
+            for (uint32_t bx = t.x0 / block_size; bx <= t.x1 / block_size;
+                 bx++) {
+                uint32_t x0 = std::max(t.x0, bx * block_size);
+                uint32_t x1 = std::min(t.x1, bx * block_size + block_size - 1);
+                bool outside = false, inside = true;
+                for (int i = 0; i < 3; i++) {
+                    int64_t lo = t.edge(i, t.a[i] >= 0 ? x0 : x1,
+                                        t.b[i] >= 0 ? y0 : y1);
+                    int64_t hi = t.edge(i, t.a[i] >= 0 ? x1 : x0,
+                                        t.b[i] >= 0 ? y1 : y0);
+                    outside = outside || hi + de_hi[i] < 0;
+                    inside = inside && lo + de_lo[i] >= 0;
+                }
+                if (outside) {
+                    continue;
+                }
+                if (!querying) {
+                    MSbuf->touch(x0, y0);
+                }
+                for (uint32_t y = y0; y <= y1; y++) {
+                    int64_t w0 = t.edge(0, x0, y);
+                    int64_t w1 = t.edge(1, x0, y);
+                    int64_t w2 = t.edge(2, x0, y);
+                    for (uint32_t x = x0; x <= x1; x++) {
+                        uint32_t covered = inside ? all : 0;
+                        for (uint32_t s = 0; !inside && s < msaa_samples;
+                             s++) {
+                            int64_t e0 = w0 + sample_de[0][s];
+                            int64_t e1 = w1 + sample_de[1][s];
+                            int64_t e2 = w2 + sample_de[2][s];
+                            covered |= uint32_t((e0 | e1 | e2) >= 0) << s;
+                        }
+                        if (covered && querying) {
+                            query_samples += test_samples(
+                                    t, x, y, w0, w1, w2, covered, sample_dz);
+                            if (query_answered()) {
+                                return;
+                            }
+                        } else if (covered) {
+                            shade_samples(t, x, y, w0, w1, w2, covered,
+                                          sample_dz);
+                        }
+                        w0 += t.a[0] * subpixel_scale;
+                        w1 += t.a[1] * subpixel_scale;
+                        w2 += t.a[2] * subpixel_scale;
+                    }
+                }
+            }
+        }
+        shade_packet_samples(t);
+    }
+
+    void transform(const Point &v_world, Vertex &v) {
+        cam->convert_to_raster(v_world, v.raster, v.cam);
+        v.outcode = clipping::compute_outcode(*cam, v.cam);
+    }
+
+    // The geometry stage: cull a triangle outside the view frustum, clip it
+    // if it crosses the near plane or the guard band, and set up what is
+    // left. emit(t) is called for each triangle to rasterise. Clipped parts
+    // keep the id and camera space vertices of the original triangle, and
+    // map their barycentrics back to it before shading. The setup step of
+    // shader, if it has one, runs for triangles which are drawn. Returns
+    // false if nothing is left to draw.
+    template <typename Emit>
+    bool process_triangle(Shader &shader, const Vertex &v0, const Vertex &v1,
+                          const Vertex &v2, uint32_t id, int64_t margin,
+                          Emit &&emit) {
+        // Outside the same frustum plane
+        if (v0.outcode & v1.outcode & v2.outcode & ~clipping::Clip) {
+            return false;
+        }
+        Triangle t;
+        t.id = id;
+        t.v0_cam = v0.cam;
+        t.v1_cam = v1.cam;
+        t.v2_cam = v2.cam;
+        if (!((v0.outcode | v1.outcode | v2.outcode) & clipping::Clip)) {
+            t.clipped = false;
+            if (!setup_triangle(v0.raster, v1.raster, v2.raster, t, margin)) {
+                return false;
+            }
+            setup_shader(shader, t);
+            emit(t);
+            return true;
+        }
+        clipping::Vertex poly[clipping::max_vertices];
+        uint32_t n = clipping::clip_triangle(*cam, v0.cam, v1.cam, v2.cam,
+                                             poly);
+        Point rast[clipping::max_vertices];
+        for (uint32_t i = 0; i < n; i++) {
+            cam->project_to_raster(poly[i].cam, rast[i]);
+        }
+        const float z[3] = {-v0.cam.z, -v1.cam.z, -v2.cam.z};
+        bool visible = false;
+        t.clipped = true;
+        // Triangulate the convex polygon as a fan
+        for (uint32_t i = 1; i + 1 < n; i++) {
+            const uint32_t k[3] = {0, i, i + 1};
+            // Screen space barycentrics b' of a part map to those of the
+            // original triangle by b_j = sum_k b'_k * B_kj * z_j / z'_k, B_kj
+            // being barycentric j of the part's vertex k
+            for (int r = 0; r < 3; r++) {
+                for (int j = 0; j < 3; j++) {
+                    t.remap[r][j] = poly[k[r]].b[j] * z[j] / rast[k[r]].z;
+                }
+            }
+            if (setup_triangle(rast[0], rast[i], rast[i + 1], t, margin)) {
+                if (!visible) {
+                    setup_shader(shader, t);
+                }
+                emit(t);
+                visible = true;
+            }
+        }
+        return visible;
+    }
+
+    static raster_mode supported(raster_mode m) {
+        const bool by_depth = State::depth_test && State::depth_write;
+        return by_depth || m == raster_mode::Immediate ? m
+                                                       : raster_mode::Binned;
+    }
+
+    // Run the shader's setup step for t, once per triangle drawn
+    static void setup_shader(Shader &shader, Triangle &t) {
+        t.interp = detail::setup(shader, t.v0_cam, t.v1_cam, t.v2_cam, t.id,
+                                 detail::has_setup<Shader>());
+    }
+
+    // An AnySamples query has seen a sample pass, so needs no more testing
+    bool query_answered() const {
+        return querying && query_kind == occlusion_query::AnySamples &&
+               query_samples > 0;
+    }
+
+    // Walks without write stop once their query is answered
+    template <bool write>
+    bool stop_walk() const {
+        return !write && query_answered();
+    }
+
+    void discard() {
+        triangles.clear();
+        for (auto &bin : bins) {
+            bin.clear();
+        }
+    }
+
+    // Rasterise a set up triangle, or queue it in the binned mode.
+    void submit(const Triangle &t) {
+        if (t.empty()) {
+            // Visible, but too thin to cover any pixel centre
+            return;
+        }
+        uint32_t tx0 = t.x0 / tile_size, tx1 = t.x1 / tile_size;
+        uint32_t ty0 = t.y0 / tile_size, ty1 = t.y1 / tile_size;
+        if (querying) {
+            for (uint32_t ty = ty0; ty <= ty1; ty++) {
+                for (uint32_t tx = tx0; tx <= tx1; tx++) {
+                    if (query_answered()) {
+                        return;
+                    }
+                    rasterise_tile<false>(
+                            t, tx, ty, *Zbuf,
+                            [&](uint32_t, uint32_t, float, float, float,
+                                float) { query_samples++; });
+                }
+            }
+        } else if (mode == raster_mode::Immediate) {
+            // Walk the tiles like the binned mode does, so that both modes
+            // step the edge functions from the same origins.
+            for (uint32_t ty = ty0; ty <= ty1; ty++) {
+                for (uint32_t tx = tx0; tx <= tx1; tx++) {
+                    draw_tile(render_triangle, packet, t, tx, ty, *Zbuf,
+                              *Fbuf);
+                }
+            }
+        } else {
+            auto idx = static_cast<uint32_t>(triangles.size());
+            bool binned = false;
+            for (uint32_t ty = ty0; ty <= ty1; ty++) {
+                for (uint32_t tx = tx0; tx <= tx1; tx++) {
+                    // Depths only decrease until the flush, so tiles already
+                    // hidden now stay hidden
+                    if (!State::depth_test ||
+                        buffers::nearer<Depth>(
+                                t.near_key, Zbuf->max_depth_tile(tx, ty))) {
+                        if (mode != raster_mode::Composited) {
+                            bins[ty * tiles_x + tx].push_back(idx);
+                        }
+                        binned = true;
+                    }
+                }
+            }
+            if (binned) {
+                triangles.push_back(t);
+            }
+        }
+    }
+
+    // Rasteriser (edge function) setup, from the raster space positions of
+    // the vertices. The camera space positions must already be in t. The
+    // bounding box covers pixels with any point within margin sub-pixels of
+    // their centre inside the triangle.
+    bool setup_triangle(const Point &v0_rast, const Point &v1_rast,
+                        const Point &v2_rast, Triangle &t,
+                        int64_t margin = 0) {
 #ifdef ALPHA_DEBUG
         std::cout << "\nThe raster coords : " << v0_rast << " | " << v1_rast
                   << " | " << v2_rast;
 #endif
-        // Precompute multiplicative inverse of the z co ordinate
-        v0_rast.z = 1 / v0_rast.z;
-        v1_rast.z = 1 / v1_rast.z;
-        v2_rast.z = 1 / v2_rast.z;
-        // Compute bounding box
-        float xmin = math::min_3(v0_rast.x, v1_rast.x, v2_rast.x);
-        float ymin = math::min_3(v0_rast.y, v1_rast.y, v2_rast.y);
-        float xmax = math::max_3(v0_rast.x, v1_rast.x, v2_rast.x);
-        float ymax = math::max_3(v0_rast.y, v1_rast.y, v2_rast.y);
-        if (xmin > width - 1 || xmax < 0 || ymax > height - 1 || ymin < 0) {
+        const Point *rast[3] = {&v0_rast, &v1_rast, &v2_rast};
+        // Snap to the sub-pixel grid
+        int64_t x[3], y[3];
+        for (int i = 0; i < 3; i++) {
+            // Negated so that NaNs are rejected as well
+            if (!(std::fabs(rast[i]->x) < max_raster_coord &&
+                  std::fabs(rast[i]->y) < max_raster_coord)) {
+                return false;
+            }
+            x[i] = snap_to_subpixel(rast[i]->x);
+            y[i] = snap_to_subpixel(rast[i]->y);
+        }
+        // Precompute what is interpolated for depth
+        t.z0_lerp = State::perspective_correct ? 1 / v0_rast.z : v0_rast.z;
+        t.z1_lerp = State::perspective_correct ? 1 / v1_rast.z : v1_rast.z;
+        t.z2_lerp = State::perspective_correct ? 1 / v2_rast.z : v2_rast.z;
+        // The interpolated depth lies between the vertex depths, up to
+        // rounding, which the margin covers
+        float z_min = math::min_3(v0_rast.z, v1_rast.z, v2_rast.z);
+        t.near_key = Zbuf->format().key(z_min - std::fabs(z_min) * 1e-5f);
+        // Compute the bounding box of the pixel centres inside the triangle.
+        // Pixel p has its centre at p * scale + scale / 2; the shifts round
+        // towards negative infinity.
+        const int64_t half = subpixel_scale / 2;
+        int64_t xmin = (math::min_3(x[0], x[1], x[2]) - half - margin +
+                        subpixel_scale - 1) >> subpixel_bits;
+        int64_t ymin = (math::min_3(y[0], y[1], y[2]) - half - margin +
+                        subpixel_scale - 1) >> subpixel_bits;
+        int64_t xmax = (math::max_3(x[0], x[1], x[2]) - half + margin) >>
+                       subpixel_bits;
+        int64_t ymax = (math::max_3(y[0], y[1], y[2]) - half + margin) >>
+                       subpixel_bits;
+        // Small triangles have tiny edge functions, which always fit in 32
+        // bits
+        t.small = xmax - xmin < int64_t(small_size) &&
+                  ymax - ymin < int64_t(small_size);
+        if (xmin > width - 1 || xmax < 0 || ymin > height - 1 || ymax < 0) {
 #ifdef ALPHA_DEBUG
             std::cout << "\nTriangle not present";
 #endif
             return false;
         }
-        typedef int32_t i32t;
-        uint32_t x0 = std::max(i32t(0), (i32t) (std::floor(xmin)));
-        uint32_t y0 = std::max(i32t(0), (i32t) (std::floor(ymin)));
-        uint32_t x1 = std::min(i32t(width) - 1, (i32t) (std::floor(xmax)));
-        uint32_t y1 = std::min(i32t(height) - 1, (i32t) (std::floor(ymax)));
-
-        float total_area_inv = 1 / edge_function(v0_rast, v1_rast, v2_rast);
+        t.x0 = static_cast<uint32_t>(std::max(xmin, int64_t(0)));
+        t.y0 = static_cast<uint32_t>(std::max(ymin, int64_t(0)));
+        t.x1 = static_cast<uint32_t>(std::min(xmax, int64_t(width - 1)));
+        t.y1 = static_cast<uint32_t>(std::min(ymax, int64_t(height - 1)));
+        // Triangle setup, edge i runs from vertex i + 1 to vertex i + 2
+        for (int i = 0; i < 3; i++) {
+            int j = (i + 1) % 3, k = (i + 2) % 3;
+            t.a[i] = y[k] - y[j];
+            t.b[i] = x[j] - x[k];
+            t.c[i] = y[j] * x[k] - x[j] * y[k];
+        }
+        int64_t area = t.a[2] * x[2] + t.b[2] * y[2] + t.c[2];
 #ifdef ALPHA_DEBUG
-        std::cout << "Total area : " << 1 / total_area_inv;
+        std::cout << "Total area : " << area;
 #endif
-        if (total_area_inv < 0.f) {
-            // We do not render negative area triangles
+        // Positive for front faces
+        if (area == 0 || (State::cull == cull_mode::Back && area < 0) ||
+            (State::cull == cull_mode::Front && area > 0)) {
             return false;
         }
-        // Triangle setup
-        float a01 = v0_rast.y - v1_rast.y, b01 = v1_rast.x - v0_rast.x;
-        float a12 = v1_rast.y - v2_rast.y, b12 = v2_rast.x - v1_rast.x;
-        float a20 = v2_rast.y - v0_rast.y, b20 = v0_rast.x - v2_rast.x;
-        // Computing the Barycentric co-ords at minX, minY
-        Point p = {float(x0) + 0.5f, float(y0) + 0.5f, 0.f};
-        float w0_row = edge_function(v1_rast, v2_rast, p);
-        float w1_row = edge_function(v2_rast, v0_rast, p);
-        float w2_row = edge_function(v0_rast, v1_rast, p);
-        // The inner loop
-        for (uint32_t y = y0; y <= y1; y++) {
-            float w0 = w0_row;
-            float w1 = w1_row;
-            float w2 = w2_row;
-            for (uint32_t x = x0; x <= x1; x++) {
-#ifdef ALPHA_DEBUG
-                std::cout << Point(w0, w1, w2) << " : " << math::Vec2i(x, y)
-                          << std::endl;
-                std::cin.get();
-#endif
-                if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
-                    float b0 = w0 * total_area_inv;
-                    float b1 = w1 * total_area_inv;
-                    float b2 = w2 * total_area_inv;
-                    // Compute correct interpolation
-                    float z_inv =
-                            v0_rast.z * b0 + v1_rast.z * b1 + v2_rast.z * b2;
-                    float z = 1 / z_inv;
-                    if (z < Zbuf->get(x, y)) {
-                        // Yay! Render
-                        Zbuf->set(x, y, z);
-                        auto col = render_triangle(b0, b1, b2, z, v0_cam,
-                                                   v1_cam, v2_cam);
-                        Fbuf->set(x, y, col.x, col.y, col.z);
-                    }
-                }
-                w0 -= a12;
-                w1 -= a20;
-                w2 -= a01;
+        if (area < 0) {
+            // Make the edge functions positive inside back faces as well
+            for (int i = 0; i < 3; i++) {
+                t.a[i] = -t.a[i];
+                t.b[i] = -t.b[i];
+                t.c[i] = -t.c[i];
             }
-            w0_row -= b12;
-            w1_row -= b20;
-            w2_row -= b01;
+            area = -area;
         }
+        for (int i = 0; i < 3; i++) {
+            // Top-left fill rule
+            bool top_left = t.a[i] > 0 || (t.a[i] == 0 && t.b[i] > 0);
+            t.bias[i] = top_left ? 0 : -1;
+        }
+        t.total_area_inv = 1.f / float(area);
         return true;
     }
 
-    void draw_triangle_16xAA(const Point &v0, const Point &v1,
-                             const Point &v2) {
-        // TODO: Optimize
-        Point v0_rast, v1_rast, v2_rast, v0_cam, v1_cam, v2_cam;
-        cam->convert_to_raster(v0, v0_rast, v0_cam);
-        cam->convert_to_raster(v1, v1_rast, v1_cam);
-        cam->convert_to_raster(v2, v2_rast, v2_cam);
-#ifdef ALPHA_DEBUG
-        std::cout << "\nThe raster coords : " << v0_rast << " | " << v1_rast
-                  << " | " << v2_rast;
+    // Rasterise the part of a triangle inside tile (tx, ty). The edge
+    // functions are integers, so stepping them is exact and the result does
+    // not depend on the order in which tiles are visited.
+    //
+    // The tile is walked in blocks of block_size x block_size pixels. Edge
+    // functions are linear, so their extremes over a block are found at its
+    // corners: blocks outside an edge are skipped, and blocks inside all
+    // three edges are filled without testing each pixel. Tiles and blocks
+    // already nearer than the triangle in the Zbuffer are skipped, and the
+    // depth bound of every block written is refreshed.
+    //
+    // sink(x, y, b0, b1, b2, z) is called for every pixel passing the depth
+    // test, after its depth is written. Without write, as for occlusion
+    // queries, the Zbuffer is only tested: tiles still cleared are tested
+    // against the clear key and left cleared, and the walk stops once an
+    // AnySamples query is answered.
+    template <bool write = State::depth_write, typename Sink>
+    void rasterise_tile(const Triangle &t, uint32_t tx, uint32_t ty,
+                        Zbuffer &zbuf, Sink &&sink) {
+        uint32_t x0 = std::max(t.x0, tx * tile_size);
+        uint32_t y0 = std::max(t.y0, ty * tile_size);
+        uint32_t x1 = std::min(t.x1, (tx + 1) * tile_size - 1);
+        uint32_t y1 = std::min(t.y1, (ty + 1) * tile_size - 1);
+#ifdef ALPHA_RASTER_STATS
+        uint64_t in_bounds = 0, tested = 0;
+        uint64_t accepted = 0, rejected = 0, partial = 0, occluded = 0;
+        in_bounds += uint64_t(y1 - y0 + 1) *
+                     (x1 - x1 % simd::width + simd::width - x0 +
+                      x0 % simd::width);
 #endif
-        // Precompute multiplicative inverse of the z co ordinate
-        v0_rast.z = 1 / v0_rast.z;
-        v1_rast.z = 1 / v1_rast.z;
-        v2_rast.z = 1 / v2_rast.z;
-        // Compute bounding box
-        float xmin = math::min_3(v0_rast.x, v1_rast.x, v2_rast.x);
-        float ymin = math::min_3(v0_rast.y, v1_rast.y, v2_rast.y);
-        float xmax = math::max_3(v0_rast.x, v1_rast.x, v2_rast.x);
-        float ymax = math::max_3(v0_rast.y, v1_rast.y, v2_rast.y);
-        if (xmin > width - 1 || xmax < 0 || ymax > height - 1 || ymin < 0) {
-#ifdef ALPHA_DEBUG
-            std::cout << "\nTriangle not present";
+        if (State::depth_test &&
+            !buffers::nearer<Depth>(t.near_key, zbuf.max_depth_tile(tx, ty))) {
+#ifdef ALPHA_RASTER_STATS
+            stats.pixels_in_bounds += in_bounds;
+            stats.tiles_occluded++;
 #endif
             return;
         }
-        typedef int32_t i32t;
-        uint32_t x0 = std::max(i32t(0), (i32t) (std::floor(xmin)));
-        uint32_t y0 = std::max(i32t(0), (i32t) (std::floor(ymin)));
-        uint32_t x1 = std::min(i32t(width) - 1, (i32t) (std::floor(xmax)));
-        uint32_t y1 = std::min(i32t(height) - 1, (i32t) (std::floor(ymax)));
-
-        float total_area_inv = 1 / edge_function(v0_rast, v1_rast, v2_rast);
-#ifdef ALPHA_DEBUG
-        std::cout << "Total area : " << 1 / total_area_inv;
+        // Tiles are cleared lazily, and the depth tiles match these
+        const bool cleared = !write && zbuf.tile_cleared(tx, ty);
+        if (!cleared) {
+            zbuf.resolve_tile(tx, ty);
+        }
+        if (t.small) {
+            // Too few pixels for classifying blocks to pay off
+#ifdef ALPHA_RASTER_STATS
+            stats.pixels_in_bounds += in_bounds;
+            stats.pixels_tested += (x1 - x0 + 1) * (y1 - y0 + 1);
+            stats.small_footprints++;
 #endif
-        // Triangle setup
-        float a01 = v0_rast.y - v1_rast.y, b01 = v1_rast.x - v0_rast.x;
-        float a12 = v1_rast.y - v2_rast.y, b12 = v2_rast.x - v1_rast.x;
-        float a20 = v2_rast.y - v0_rast.y, b20 = v0_rast.x - v2_rast.x;
-        // Computing the Barycentric co-ords at minX, minY
-        Point p = {float(x0) + 0.5f, float(y0) + 0.5f, 0.f};
-        float w0_row = edge_function(v1_rast, v2_rast, p);
-        float w1_row = edge_function(v2_rast, v0_rast, p);
-        float w2_row = edge_function(v0_rast, v1_rast, p);
+            if (rasterise_small<write>(t, zbuf, x0, y0, x1, y1, cleared,
+                                       sink) &&
+                write) {
+                for (uint32_t by = y0 / block_size; by <= y1 / block_size;
+                     by++) {
+                    for (uint32_t bx = x0 / block_size;
+                         bx <= x1 / block_size; bx++) {
+                        zbuf.update_block(bx, by);
+                    }
+                }
+            }
+            return;
+        }
+        const int64_t lo_limit = std::numeric_limits<int32_t>::min() + 1;
+        const int64_t hi_limit = std::numeric_limits<int32_t>::max();
+        for (uint32_t by = y0 / block_size;
+             by <= y1 / block_size && !stop_walk<write>(); by++) {
+            uint32_t cy0 = std::max(y0, by * block_size);
+            uint32_t cy1 = std::min(y1, by * block_size + block_size - 1);
+            for (uint32_t bx = x0 / block_size;
+                 bx <= x1 / block_size && !stop_walk<write>(); bx++) {
+                // Whole blocks are aligned to the vector width, so these
+                // are the pixels the vector path steps over
+                uint32_t cx0 = bx * block_size;
+                uint32_t cx1 = cx0 + block_size - 1;
+                if (State::depth_test &&
+                    !buffers::nearer<Depth>(t.near_key,
+                                            zbuf.max_depth_block(bx, by))) {
+#ifdef ALPHA_RASTER_STATS
+                    occluded++;
+#endif
+                    continue;
+                }
+                bool outside = false, inside = true, fits = true;
+                for (int i = 0; i < 3; i++) {
+                    int64_t lo = t.edge(i, t.a[i] >= 0 ? cx0 : cx1,
+                                        t.b[i] >= 0 ? cy0 : cy1);
+                    int64_t hi = t.edge(i, t.a[i] >= 0 ? cx1 : cx0,
+                                        t.b[i] >= 0 ? cy1 : cy0);
+                    outside = outside || hi + t.bias[i] < 0;
+                    inside = inside && lo + t.bias[i] >= 0;
+                    fits = fits && lo >= lo_limit && hi <= hi_limit;
+                }
+                if (outside) {
+#ifdef ALPHA_RASTER_STATS
+                    rejected++;
+#endif
+                    continue;
+                }
+                uint32_t rx0 = std::max(x0, cx0), rx1 = std::min(x1, cx1);
+#ifdef ALPHA_RASTER_STATS
+                if (inside) {
+                    accepted++;
+                } else {
+                    partial++;
+                    tested += uint64_t(cy1 - cy0 + 1) *
+                              (rx1 - rx1 % simd::width + simd::width - rx0 +
+                               rx0 % simd::width);
+                }
+#endif
+                bool written =
+                        fits ? rasterise_block<write>(t, zbuf, rx0, cy0, rx1,
+                                                      cy1, inside, cleared,
+                                                      sink)
+                             : rasterise_rect_wide<write>(t, zbuf, rx0, cy0,
+                                                          rx1, cy1, cleared,
+                                                          sink);
+                if (written && write) {
+                    zbuf.update_block(bx, by);
+                }
+            }
+        }
+#ifdef ALPHA_RASTER_STATS
+        stats.pixels_in_bounds += in_bounds;
+        stats.pixels_tested += tested;
+        stats.blocks_accepted += accepted;
+        stats.blocks_rejected += rejected;
+        stats.blocks_partial += partial;
+        stats.blocks_occluded += occluded;
+#endif
+    }
+
+    // Pixels are processed simd::width at a time, in groups aligned to the
+    // vector width. The edge functions, coverage and depth keys are
+    // computed for the whole group, and the depth test and write are masked
+    // into the Zbuffer row. Only the sink runs per pixel.
+    // Coverage is not tested when the block is known to be inside, and
+    // depths are not read from a cleared tile. Returns true if any pixel
+    // passed the depth test, whose depth is written if write is set.
+    template <bool write, typename Sink>
+    bool rasterise_block(const Triangle &t, Zbuffer &zbuf,
+                         uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1,
+                         bool inside_all, bool cleared, Sink &sink) {
+        using simd::vfloat;
+        using simd::vint;
+        using simd::vmask;
+        const uint32_t gx0 = x0 - x0 % simd::width;
+        // Computing the edge functions at the first group, minY
+        int64_t w_row[3];
+        vint step[3], bias[3];
+        for (int i = 0; i < 3; i++) {
+            w_row[i] = t.edge(i, gx0, y0);
+            step[i] = simd::ramp(int32_t(t.a[i] * subpixel_scale));
+            bias[i] = simd::set1(int32_t(t.bias[i]));
+        }
+        const int64_t group_step[3] = {
+                t.a[0] * subpixel_scale * simd::width,
+                t.a[1] * subpixel_scale * simd::width,
+                t.a[2] * subpixel_scale * simd::width};
+
+        const Depth &fmt = zbuf.format();
+        const vfloat clear_key = simd::set1(fmt.clear_key());
+        const vfloat area_inv = simd::set1(t.total_area_inv);
+        const vfloat z0 = simd::set1(t.z0_lerp), z1 = simd::set1(t.z1_lerp),
+                     z2 = simd::set1(t.z2_lerp);
+        // Lanes left of x0 or right of x1 belong to a neighbouring region
+        const vint lanes = simd::ramp(1);
+        const vint before = simd::set1(int32_t(x0) - 1);
+        const vint after = simd::set1(int32_t(x1) + 1);
+
+        bool written = false;
+        alignas(32) float b0s[simd::width], b1s[simd::width],
+                b2s[simd::width], zs[simd::width];
         // The inner loop
         for (uint32_t y = y0; y <= y1; y++) {
-            float w0 = w0_row;
-            float w1 = w1_row;
-            float w2 = w2_row;
+            int64_t w[3] = {w_row[0], w_row[1], w_row[2]};
+            // The rest of the block row is contiguous
+            ztype *zrow = cleared ? nullptr : zbuf.span(gx0, y);
+            for (uint32_t gx = gx0; gx <= x1; gx += simd::width) {
+                const vint w0 = simd::set1(int32_t(w[0])) + step[0];
+                const vint w1 = simd::set1(int32_t(w[1])) + step[1];
+                const vint w2 = simd::set1(int32_t(w[2])) + step[2];
+                w[0] += group_step[0];
+                w[1] += group_step[1];
+                w[2] += group_step[2];
+                const vint xs = simd::set1(int32_t(gx)) + lanes;
+                vmask inside = (xs > before) & (after > xs);
+                if (!inside_all) {
+                    inside = inside &
+                             simd::nonneg((w0 + bias[0]) | (w1 + bias[1]) |
+                                          (w2 + bias[2]));
+                    if (!simd::bits(inside)) {
+                        continue;
+                    }
+                }
+                const vfloat b0 = simd::to_float(w0) * area_inv;
+                const vfloat b1 = simd::to_float(w1) * area_inv;
+                const vfloat b2 = simd::to_float(w2) * area_inv;
+                const vfloat z_lerp = z0 * b0 + z1 * b1 + z2 * b2;
+                const vfloat key = depth_key(fmt, z_lerp);
+                const vfloat depth =
+                        cleared ? clear_key
+                                : buffers::load_keys(zrow + (gx - gx0));
+                const vmask pass =
+                        State::depth_test
+                                ? inside & buffers::nearer<Depth>(key, depth)
+                                : inside;
+                uint32_t mask = simd::bits(pass);
+                if (!mask) {
+                    continue;
+                }
+                // Yay! Render
+                written = true;
+                if (write) {
+                    buffers::store_keys(zrow + (gx - gx0),
+                                        simd::select(pass, key, depth));
+                }
+                simd::store(b0s, b0);
+                simd::store(b1s, b1);
+                simd::store(b2s, b2);
+                // Keys are depths for float_depth; other formats only
+                // divide for the pixels which pass
+                simd::store(zs, Depth::exact ? key : resolve_depth(z_lerp));
+                for (uint32_t i = 0; i < simd::width; i++) {
+                    if (mask & (1u << i)) {
+                        sink(gx + i, y, b0s[i], b1s[i], b2s[i], zs[i]);
+                        if (stop_walk<write>()) {
+                            return written;
+                        }
+                    }
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                w_row[i] += t.b[i] * subpixel_scale;
+            }
+        }
+        return written;
+    }
+
+    // The fast path for small triangles. The rows of the region, at most
+    // small_size pixels square, are laid out one after the other in a
+    // footprint of small_size candidates each, whose coverage, depth and
+    // depth test are computed a vector at a time with no per row or per
+    // block set up. Candidates outside the region are made to fail the edge
+    // tests. The arithmetic is that of rasterise_block, so both give the
+    // same pixels and depths.
+    template <bool write, typename Sink>
+    bool rasterise_small(const Triangle &t, Zbuffer &zbuf,
+                         uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1,
+                         bool cleared, Sink &sink) {
+        using simd::vfloat;
+        using simd::vint;
+        using simd::vmask;
+        const uint32_t rows = y1 - y0 + 1, cols = x1 - x0 + 1;
+        // Whole vectors of candidates
+        const uint32_t n = (rows * small_size + simd::width - 1) /
+                           simd::width * simd::width;
+        alignas(32) int32_t w[3][small_pixels];
+        // Depth keys
+        alignas(32) float depth[small_pixels];
+        for (int i = 0; i < 3; i++) {
+            // Small edge functions fit in 32 bits
+            auto row = int32_t(t.edge(i, x0, y0));
+            auto dx = int32_t(t.a[i] * subpixel_scale);
+            auto dy = int32_t(t.b[i] * subpixel_scale);
+            for (uint32_t k = 0; k < n; k += small_size) {
+                for (uint32_t j = 0; j < small_size; j++) {
+                    w[i][k + j] = row + int32_t(j) * dx;
+                }
+                row += dy;
+            }
+        }
+        for (uint32_t k = 0; k < n; k++) {
+            uint32_t x = k % small_size, y = k / small_size;
+            if (x < cols && y < rows) {
+                depth[k] = cleared ? zbuf.format().clear_key()
+                                   : float(*zbuf.span(x0 + x, y0 + y));
+            } else {
+                // Negative even with the bias added
+                w[0][k] = std::numeric_limits<int32_t>::min() / 2;
+                depth[k] = 0;
+            }
+        }
+        const vint bias0 = simd::set1(int32_t(t.bias[0]));
+        const vint bias1 = simd::set1(int32_t(t.bias[1]));
+        const vint bias2 = simd::set1(int32_t(t.bias[2]));
+        const Depth &fmt = zbuf.format();
+        const vfloat area_inv = simd::set1(t.total_area_inv);
+        const vfloat z0 = simd::set1(t.z0_lerp), z1 = simd::set1(t.z1_lerp),
+                     z2 = simd::set1(t.z2_lerp);
+        alignas(32) float b0s[small_pixels], b1s[small_pixels],
+                b2s[small_pixels], zs[small_pixels];
+        uint32_t passed = 0;
+        for (uint32_t k = 0; k < n; k += simd::width) {
+            const vint w0 = simd::load(w[0] + k);
+            const vint w1 = simd::load(w[1] + k);
+            const vint w2 = simd::load(w[2] + k);
+            const vmask inside =
+                    simd::nonneg((w0 + bias0) | (w1 + bias1) | (w2 + bias2));
+            if (!simd::bits(inside)) {
+                continue;
+            }
+            const vfloat b0 = simd::to_float(w0) * area_inv;
+            const vfloat b1 = simd::to_float(w1) * area_inv;
+            const vfloat b2 = simd::to_float(w2) * area_inv;
+            const vfloat z_lerp = z0 * b0 + z1 * b1 + z2 * b2;
+            const vfloat key = depth_key(fmt, z_lerp);
+            const vfloat d = simd::load(depth + k);
+            const vmask pass = State::depth_test
+                                       ? inside & buffers::nearer<Depth>(key, d)
+                                       : inside;
+            uint32_t mask = simd::bits(pass);
+            if (!mask) {
+                continue;
+            }
+            passed |= mask << k;
+            simd::store(depth + k, key);
+            if (!Depth::exact) {
+                simd::store(zs + k, resolve_depth(z_lerp));
+            }
+            simd::store(b0s + k, b0);
+            simd::store(b1s + k, b1);
+            simd::store(b2s + k, b2);
+        }
+        // In row order, like the block walk
+        for (uint32_t bits = passed; bits; bits &= bits - 1) {
+            uint32_t k = 0;
+            while (!(bits & (1u << k))) {
+                k++;
+            }
+            uint32_t x = x0 + k % small_size, y = y0 + k / small_size;
+            if (write) {
+                *zbuf.span(x, y) = static_cast<ztype>(depth[k]);
+            }
+            sink(x, y, b0s[k], b1s[k], b2s[k],
+                 Depth::exact ? depth[k] : zs[k]);
+            if (stop_walk<write>()) {
+                break;
+            }
+        }
+        return passed != 0;
+    }
+
+    // The depth key from the interpolated z*_lerp
+    template <typename T>
+    static T depth_key(const Depth &fmt, T v) {
+        return State::perspective_correct ? fmt.key_inverse(v) : fmt.key(v);
+    }
+
+    // Depth from the interpolated z*_lerp
+    static float resolve_depth(float v) {
+        return State::perspective_correct ? 1.f / v : v;
+    }
+
+    static simd::vfloat resolve_depth(simd::vfloat v) {
+        return State::perspective_correct ? simd::set1(1.f) / v : v;
+    }
+
+    // Scalar fallback for the rare regions whose edge functions need more
+    // than 32 bits, such as huge triangles on very large framebuffers.
+    template <bool write, typename Sink>
+    bool rasterise_rect_wide(const Triangle &t, Zbuffer &zbuf,
+                             uint32_t x0, uint32_t y0, uint32_t x1,
+                             uint32_t y1, bool cleared, Sink &sink) {
+        bool written = false;
+        for (uint32_t y = y0; y <= y1; y++) {
+            int64_t w0 = t.edge(0, x0, y);
+            int64_t w1 = t.edge(1, x0, y);
+            int64_t w2 = t.edge(2, x0, y);
             for (uint32_t x = x0; x <= x1; x++) {
-#ifdef ALPHA_DEBUG
-                std::cout << Point(w0, w1, w2) << " : " << math::Vec2i(x, y)
-                          << std::endl;
-                std::cin.get();
-#endif
-                if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
-
-                    float z_inv = v0_rast.z * w0 * total_area_inv +
-                                  v1_rast.z * w1 * total_area_inv +
-                                  v2_rast.z * w2 * total_area_inv;
-                    float z = 1 / z_inv;
-                    if (z < Zbuf->get(x, y)) {
-                        Zbuf->set(x, y, z);
-                        std::vector<Point> pixel_samples(16);
-                        // Use 16 samples per pixel
-                        pixel_samples[0].x = w0 + 3.f / 8 * a12 + 3.f / 8 * b12;
-                        pixel_samples[0].y = w1 + 3.f / 8 * a20 + 3.f / 8 * b20;
-                        pixel_samples[0].z = w2 + 3.f / 8 * a01 + 3.f / 8 * b01;
-                        for (int i = 1; i < 4; i++) {
-                            pixel_samples[4 * i].x =
-                                    pixel_samples[4 * (i - 1)].x - 0.25f * b12;
-                            pixel_samples[4 * i].y =
-                                    pixel_samples[4 * (i - 1)].y - 0.25f * b20;
-                            pixel_samples[4 * i].z =
-                                    pixel_samples[4 * (i - 1)].z - 0.25f * b01;
+                if (((w0 + t.bias[0]) | (w1 + t.bias[1]) |
+                     (w2 + t.bias[2])) >= 0) {
+                    float b0 = float(w0) * t.total_area_inv;
+                    float b1 = float(w1) * t.total_area_inv;
+                    float b2 = float(w2) * t.total_area_inv;
+                    float z_lerp = t.z0_lerp * b0 + t.z1_lerp * b1 +
+                                   t.z2_lerp * b2;
+                    float key = depth_key(zbuf.format(), z_lerp);
+                    float stored = cleared ? zbuf.format().clear_key()
+                                           : float(*zbuf.span(x, y));
+                    if (!State::depth_test ||
+                        buffers::nearer<Depth>(key, stored)) {
+                        if (write) {
+                            *zbuf.span(x, y) = static_cast<ztype>(key);
                         }
-                        for (int i = 0; i < 4; i++) {
-                            for (int j = 1; j < 4; j++) {
-                                pixel_samples[4 * i + j].x =
-                                        pixel_samples[4 * i + j - 1].x - 0.25f * a12;
-                                pixel_samples[4 * i + j].y =
-                                        pixel_samples[4 * i + j - 1].y - 0.25f * a20;
-                                pixel_samples[4 * i + j].z =
-                                        pixel_samples[4 * i + j - 1].z - 0.25f * a01;
-                            }
+                        written = true;
+                        sink(x, y, b0, b1, b2,
+                             Depth::exact ? key : resolve_depth(z_lerp));
+                        if (stop_walk<write>()) {
+                            return written;
                         }
-                        float b0 = w0, b1 = w1, b2 = w2;
-                        alpha::math::Vec3f total_color  = {0, 0, 0};
-                        for (auto elem : pixel_samples) {
-                            b0 = elem.x, b1 = elem.y, b2 = elem.z;
-                            b0 *= total_area_inv;
-                            b1 *= total_area_inv;
-                            b2 *= total_area_inv;
-							auto col = render_triangle(b0, b1, b2, z, v0_cam, v1_cam, v2_cam);
-							alpha::math::Vec3f sample_col = { col.x / 16.f, col.y / 16.f, col.z / 16.f };
-                            total_color = total_color + sample_col;
+                    }
+                }
+                w0 += t.a[0] * subpixel_scale;
+                w1 += t.a[1] * subpixel_scale;
+                w2 += t.a[2] * subpixel_scale;
+            }
+        }
+        return written;
+    }
+
+    // Sort-last rendering for the composited mode. The queued triangles are
+    // split into contiguous runs, one per worker. The first run is drawn
+    // into Fbuf and Zbuf, the others into layers of their own, with no
+    // synchronisation. The layers are then merged into Fbuf and Zbuf in
+    // order. A pixel takes the nearest depth, and ties go to the earlier
+    // layer, just as they go to the earlier triangle in the other modes, so
+    // the output is identical to theirs.
+    void flush_composited() {
+        const auto n = static_cast<int>(std::min<size_t>(
+                num_threads, (triangles.size() + composite_min - 1) /
+                                     composite_min));
+        layers.resize(n - 1);
+        for (auto &layer : layers) {
+            if (!layer.Zbuf) {
+                layer.Zbuf = std::unique_ptr<Zbuffer>(
+                        new Zbuffer(width, height,
+                                    cam->get_far_clipping_plain(),
+                                    cam->get_near_clipping_plain()));
+            }
+            if (State::colour_write && !layer.Fbuf) {
+                layer.Fbuf = std::unique_ptr<Imagebuffer>(
+                        new Imagebuffer(width, height));
+            }
+        }
+        const auto n_tile_rows = static_cast<int>(tiles_y);
+#pragma omp parallel num_threads(n)
+        {
+            Shader shader = render_triangle;
+            shaders::pixel_packet pixels;
+#pragma omp for schedule(static, 1)
+            for (int k = 0; k < n; k++) {
+                Zbuffer &zbuf = k ? *layers[k - 1].Zbuf : *Zbuf;
+                // Without colour_write fbuf is never touched
+                Imagebuffer &fbuf =
+                        k && State::colour_write ? *layers[k - 1].Fbuf : *Fbuf;
+                if (k) {
+                    // Untouched pixels stay at the far plane and never win,
+                    // so the colours need no clearing. Untouched tiles are
+                    // not even filled.
+                    zbuf.clear();
+                }
+                size_t first = triangles.size() * k / n;
+                size_t last = triangles.size() * (k + 1) / n;
+                for (size_t i = first; i < last; i++) {
+                    const Triangle &t = triangles[i];
+                    for (uint32_t ty = t.y0 / tile_size;
+                         ty <= t.y1 / tile_size; ty++) {
+                        for (uint32_t tx = t.x0 / tile_size;
+                             tx <= t.x1 / tile_size; tx++) {
+                            draw_tile(shader, pixels, t, tx, ty, zbuf, fbuf);
+                        }
+                    }
+                }
+            }
+            // A row of tiles at a time, so that each worker owns the depth
+            // bounds it refreshes
+#pragma omp for schedule(dynamic, 1)
+            for (int ty = 0; ty < n_tile_rows; ty++) {
+                const uint32_t tile_blocks = tile_size / block_size;
+                uint32_t by0 = uint32_t(ty) * tile_blocks;
+                uint32_t by1 = std::min(by0 + tile_blocks,
+                                        (height + block_size - 1) /
+                                                block_size);
+                for (uint32_t by = by0; by < by1; by++) {
+                    for (uint32_t bx = 0; bx * block_size < uint32_t(width);
+                         bx++) {
+                        if (composite_block(bx, by)) {
+                            Zbuf->update_block(bx, by);
                         }
-						Fbuf->set(x, y, static_cast<uint8_t>(total_color.x),
-							static_cast<uint8_t>(total_color.y),
-							static_cast<uint8_t>(total_color.z));
                     }
                 }
-                w0 -= a12;
-                w1 -= a20;
-                w2 -= a01;
             }
-            w0_row -= b12;
-            w1_row -= b20;
-            w2_row -= b01;
+        }
+    }
+
+    // Merge the layers into block (bx, by) of Fbuf and Zbuf, a vector of
+    // depths at a time. Layers whose tile is still cleared have nothing to
+    // merge. Returns true if any pixel changed.
+    bool composite_block(uint32_t bx, uint32_t by) {
+        bool changed = false;
+        const uint32_t x0 = bx * block_size, y0 = by * block_size;
+        const uint32_t y1 = std::min(y0 + block_size, uint32_t(height));
+        const uint32_t tx = x0 / tile_size, ty = y0 / tile_size;
+        bool drawn = false;
+        for (auto &layer : layers) {
+            drawn = drawn || !layer.Zbuf->tile_cleared(tx, ty);
+        }
+        if (!drawn) {
+            return false;
+        }
+        Zbuf->resolve_tile(tx, ty);
+        for (uint32_t y = y0; y < y1; y++) {
+            ztype *zrow = Zbuf->span(x0, y);
+            for (auto &layer : layers) {
+                if (layer.Zbuf->tile_cleared(tx, ty)) {
+                    continue;
+                }
+                const ztype *lrow = layer.Zbuf->span(x0, y);
+                // Blocks lie within the padded rows, and their rows are
+                // contiguous
+                for (uint32_t gx = x0; gx < x0 + block_size;
+                     gx += simd::width) {
+                    const simd::vfloat depth =
+                            buffers::load_keys(zrow + (gx - x0));
+                    const simd::vfloat near =
+                            buffers::load_keys(lrow + (gx - x0));
+                    const simd::vmask nearer =
+                            buffers::nearer<Depth>(near, depth);
+                    uint32_t mask = simd::bits(nearer);
+                    if (!mask) {
+                        continue;
+                    }
+                    changed = true;
+                    buffers::store_keys(zrow + (gx - x0),
+                                        simd::select(nearer, near, depth));
+                    if (!State::colour_write) {
+                        continue;
+                    }
+                    for (uint32_t i = 0; i < simd::width; i++) {
+                        if (mask & (1u << i)) {
+                            Fbuf->pixel(gx + i, y) =
+                                    layer.Fbuf->pixel(gx + i, y);
+                        }
+                    }
+                }
+            }
+        }
+        return changed;
+    }
+
+    // Rasterise the part of t inside tile (tx, ty) into zbuf, and shade the
+    // pixels passing the depth test into fbuf.
+    void draw_tile(Shader &shader, shaders::pixel_packet &pixels,
+                   const Triangle &t, uint32_t tx, uint32_t ty,
+                   Zbuffer &zbuf, Imagebuffer &fbuf) {
+        if (!State::colour_write) {
+            rasterise_tile(t, tx, ty, zbuf,
+                           [](uint32_t, uint32_t, float, float, float,
+                              float) {});
+            return;
+        }
+        begin_packet(pixels, t);
+        rasterise_tile(t, tx, ty, zbuf, [&](uint32_t x, uint32_t y, float b0,
+                                            float b1, float b2, float z) {
+            if (queue_pixel(pixels, t, x, y, b0, b1, b2, z)) {
+                shade_packet(shader, pixels, t, fbuf);
+            }
+        });
+        shade_packet(shader, pixels, t, fbuf);
+    }
+
+    // Resolve visibility for every triangle binned to a tile, then shade
+    // each covered pixel once. Runs of pixels from the same triangle are
+    // shaded together. visible is tile_size * tile_size scratch.
+    void shade_tile_deferred(Shader &shader, shaders::pixel_packet &pixels,
+                             std::vector<Visible> &visible, uint32_t tile) {
+        uint32_t tx = tile % tiles_x, ty = tile / tiles_x;
+        std::fill(visible.begin(), visible.end(),
+                  Visible{no_triangle, 0, 0, 0, 0});
+        for (auto idx : bins[tile]) {
+            rasterise_tile(triangles[idx], tx, ty, *Zbuf,
+                           [&](uint32_t x, uint32_t y, float b0, float b1,
+                               float b2, float z) {
+                visible[(y % tile_size) * tile_size + x % tile_size] =
+                        Visible{idx, b0, b1, b2, z};
+            });
+        }
+        if (!State::colour_write) {
+            return;
+        }
+        uint32_t x0 = tx * tile_size, y0 = ty * tile_size;
+        uint32_t x1 = std::min(x0 + tile_size, uint32_t(width));
+        uint32_t y1 = std::min(y0 + tile_size, uint32_t(height));
+        const Triangle *current = nullptr;
+        pixels.count = 0;
+        for (uint32_t y = y0; y < y1; y++) {
+            const Visible *v = &visible[(y - y0) * tile_size];
+            for (uint32_t x = x0; x < x1; x++, v++) {
+                if (v->triangle == no_triangle) {
+                    continue;
+                }
+                const Triangle &t = triangles[v->triangle];
+                if (&t != current) {
+                    if (current) {
+                        shade_packet(shader, pixels, *current, *Fbuf);
+                    }
+                    begin_packet(pixels, t);
+                    current = &t;
+                }
+                if (queue_pixel(pixels, t, x, y, v->b0, v->b1, v->b2,
+                                v->z)) {
+                    shade_packet(shader, pixels, t, *Fbuf);
+                }
+            }
+        }
+        if (current) {
+            shade_packet(shader, pixels, *current, *Fbuf);
+        }
+    }
+
+    // The number of covered samples of pixel (x, y) which pass the depth
+    // test, for occlusion queries: nothing is written. An AnySamples query
+    // stops at the first.
+    uint32_t test_samples(const Triangle &t, uint32_t x, uint32_t y,
+                          int64_t w0, int64_t w1, int64_t w2,
+                          uint32_t covered, const float *sample_dz) {
+        float b0 = float(w0) * t.total_area_inv;
+        float b1 = float(w1) * t.total_area_inv;
+        float b2 = float(w2) * t.total_area_inv;
+        float z_lerp = t.z0_lerp * b0 + t.z1_lerp * b1 + t.z2_lerp * b2;
+        const float *depths = MSbuf->depths(x, y);
+        uint32_t passed = 0;
+        for (uint32_t s = 0; s < msaa_samples; s++) {
+            if ((covered & (1u << s)) &&
+                (!State::depth_test ||
+                 resolve_depth(z_lerp + sample_dz[s]) < depths[s])) {
+                passed++;
+                if (query_kind == occlusion_query::AnySamples) {
+                    break;
+                }
+            }
+        }
+        return passed;
+    }
+
+    // Depth test the covered samples of pixel (x, y) and, if any pass, queue
+    // the pixel for shading once at its centre. w0, w1, w2 are the edge
+    // functions there.
+    void shade_samples(const Triangle &t, uint32_t x, uint32_t y, int64_t w0,
+                       int64_t w1, int64_t w2, uint32_t covered,
+                       const float *sample_dz) {
+        float b0 = float(w0) * t.total_area_inv;
+        float b1 = float(w1) * t.total_area_inv;
+        float b2 = float(w2) * t.total_area_inv;
+        float z_lerp = t.z0_lerp * b0 + t.z1_lerp * b1 + t.z2_lerp * b2;
+        float *depths = MSbuf->depths(x, y);
+        uint32_t passed = 0;
+        for (uint32_t s = 0; s < msaa_samples; s++) {
+            if (covered & (1u << s)) {
+                float z = resolve_depth(z_lerp + sample_dz[s]);
+                if (!State::depth_test || z < depths[s]) {
+                    if (State::depth_write) {
+                        depths[s] = z;
+                    }
+                    passed |= 1u << s;
+                }
+            }
+        }
+        if (!passed || !State::colour_write) {
+            return;
+        }
+        samples_passed[packet.count] = passed;
+        if (queue_pixel(packet, t, x, y, b0, b1, b2, resolve_depth(z_lerp))) {
+            shade_packet_samples(t);
+        }
+    }
+
+    static void begin_packet(shaders::pixel_packet &p, const Triangle &t) {
+        p.triangle = {t.v0_cam, t.v1_cam, t.v2_cam, t.id};
+        p.count = 0;
+    }
+
+    // Add a pixel of t, which must be the triangle p was begun with, to the
+    // packet. Returns true once the packet is full.
+    static bool queue_pixel(shaders::pixel_packet &p, const Triangle &t,
+                            uint32_t x, uint32_t y, float b0, float b1,
+                            float b2, float z) {
+        unclip(t, b0, b1, b2);
+        uint32_t i = p.count++;
+        p.x[i] = x;
+        p.y[i] = y;
+        p.b0[i] = b0;
+        p.b1[i] = b1;
+        p.b2[i] = b2;
+        p.z[i] = z;
+        return p.count == shaders::packet_size;
+    }
+
+    // Shade the queued pixels of t into fbuf and empty the packet
+    void shade_packet(Shader &shader, shaders::pixel_packet &p,
+                      const Triangle &t, Imagebuffer &fbuf) {
+        if (!p.count) {
+            return;
+        }
+        RGB colours[shaders::packet_size];
+        shaders::shade_packet(shader, p, t.interp, colours);
+        write_packet(p, colours, fbuf,
+                     std::integral_constant<bool, Colour::packed>());
+        p.count = 0;
+    }
+
+    static void write_packet(const shaders::pixel_packet &p,
+                             const RGB *colours, Imagebuffer &fbuf,
+                             std::false_type) {
+        for (uint32_t i = 0; i < p.count; i++) {
+            fbuf.set(p.x[i], p.y[i], colours[i].x, colours[i].y,
+                     colours[i].z);
+        }
+    }
+
+    // Packed pixels are stored in runs along block rows, which packets of
+    // pixels from the block walk are mostly made of.
+    static void write_packet(const shaders::pixel_packet &p,
+                             const RGB *colours, Imagebuffer &fbuf,
+                             std::true_type) {
+        typename Colour::type packed[shaders::packet_size];
+        for (uint32_t i = 0; i < p.count; i++) {
+            packed[i] = Colour::pack(colours[i].x, colours[i].y,
+                                     colours[i].z);
+        }
+        for (uint32_t i = 0; i < p.count;) {
+            uint32_t n = 1;
+            while (i + n < p.count && p.y[i + n] == p.y[i] &&
+                   p.x[i + n] == p.x[i] + n &&
+                   p.x[i + n] % block_size != 0) {
+                n++;
+            }
+            fbuf.set_run(p.x[i], p.y[i], packed + i, n);
+            i += n;
+        }
+    }
+
+    // Shade the queued pixels of t into the samples of MSbuf they passed
+    void shade_packet_samples(const Triangle &t) {
+        if (!packet.count) {
+            return;
+        }
+        RGB colours[shaders::packet_size];
+        shaders::shade_packet(render_triangle, packet, t.interp, colours);
+        for (uint32_t i = 0; i < packet.count; i++) {
+            uint8_t *colors = MSbuf->colors(packet.x[i], packet.y[i]);
+            for (uint32_t s = 0; s < msaa_samples; s++) {
+                if (samples_passed[i] & (1u << s)) {
+                    colors[3 * s] = colours[i].x;
+                    colors[3 * s + 1] = colours[i].y;
+                    colors[3 * s + 2] = colours[i].z;
+                }
+            }
+        }
+        packet.count = 0;
+    }
+
+    static void unclip(const Triangle &t, float &b0, float &b1, float &b2) {
+        if (t.clipped) {
+            float c0 = b0 * t.remap[0][0] + b1 * t.remap[1][0] +
+                       b2 * t.remap[2][0];
+            float c1 = b0 * t.remap[0][1] + b1 * t.remap[1][1] +
+                       b2 * t.remap[2][1];
+            float c2 = b0 * t.remap[0][2] + b1 * t.remap[1][2] +
+                       b2 * t.remap[2][2];
+            b0 = c0;
+            b1 = c1;
+            b2 = c2;
         }
     }
 };
+
+template <typename Shader, typename State, typename Depth, typename Layout,
+          typename Colour>
+constexpr int8_t Rasteriser<Shader, State, Depth, Layout,
+                            Colour>::msaa_offsets[msaa_samples][2];
 }
 #endif
@@ -0,0 +1,281 @@
+//===---- simd ------------ Portable vector types ----------------*- C++ -*-===//
+//
+// Alpha-trace -> Minimal C++ raytracer
+//
+// Written by: Shikhar Bhardwaj | shikhar@bluefog.me
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Thin wrappers over the widest vectors the target supports. AVX2
+/// gives 8 lanes, SSE2 gives 4 and anything else falls back to 1, so code
+/// written against these types has a single path on every platform.
+///
+//===----------------------------------------------------------------------===//
+#ifndef SIMD_ALPHA_HPP
+#define SIMD_ALPHA_HPP
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define ALPHA_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || \
+      (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ALPHA_SIMD_SSE2
+#endif
+
+namespace alpha {
+namespace simd {
+
+#if defined(ALPHA_SIMD_AVX2)
+constexpr uint32_t width = 8;
+
+struct vfloat { __m256 v; };
+struct vmask { __m256 v; };
+
+inline vfloat set1(float a) { return {_mm256_set1_ps(a)}; }
+
+// The lane indices, 0 to width - 1
+inline vfloat lanes() {
+    return {_mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f)};
+}
+
+inline vfloat load(const float *p) { return {_mm256_loadu_ps(p)}; }
+
+inline void store(float *p, vfloat a) { _mm256_storeu_ps(p, a.v); }
+
+inline vfloat operator+(vfloat a, vfloat b) {
+    return {_mm256_add_ps(a.v, b.v)};
+}
+inline vfloat operator-(vfloat a, vfloat b) {
+    return {_mm256_sub_ps(a.v, b.v)};
+}
+inline vfloat operator*(vfloat a, vfloat b) {
+    return {_mm256_mul_ps(a.v, b.v)};
+}
+inline vfloat operator/(vfloat a, vfloat b) {
+    return {_mm256_div_ps(a.v, b.v)};
+}
+
+inline vmask operator<(vfloat a, vfloat b) {
+    return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)};
+}
+inline vmask operator<=(vfloat a, vfloat b) {
+    return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)};
+}
+inline vmask operator>=(vfloat a, vfloat b) {
+    return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)};
+}
+
+inline vmask operator&(vmask a, vmask b) { return {_mm256_and_ps(a.v, b.v)}; }
+
+inline vfloat min(vfloat a, vfloat b) { return {_mm256_min_ps(a.v, b.v)}; }
+inline vfloat max(vfloat a, vfloat b) { return {_mm256_max_ps(a.v, b.v)}; }
+
+// Lanes of a where the mask is set, lanes of b elsewhere
+inline vfloat select(vmask m, vfloat a, vfloat b) {
+    return {_mm256_blendv_ps(b.v, a.v, m.v)};
+}
+
+// One bit per lane, lane 0 in the lowest bit
+inline uint32_t bits(vmask m) {
+    return static_cast<uint32_t>(_mm256_movemask_ps(m.v));
+}
+
+struct vint { __m256i v; };
+
+inline vint set1(int32_t a) { return {_mm256_set1_epi32(a)}; }
+
+inline vint load(const int32_t *p) {
+    return {_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p))};
+}
+
+// {0, step, 2 * step, ...}, wrapping on overflow
+inline vint ramp(int32_t step) {
+    auto s = static_cast<uint32_t>(step);
+    return {_mm256_setr_epi32(0, int32_t(s), int32_t(2 * s), int32_t(3 * s),
+                              int32_t(4 * s), int32_t(5 * s), int32_t(6 * s),
+                              int32_t(7 * s))};
+}
+
+inline vint operator+(vint a, vint b) { return {_mm256_add_epi32(a.v, b.v)}; }
+inline vint operator|(vint a, vint b) { return {_mm256_or_si256(a.v, b.v)}; }
+
+inline vmask operator>(vint a, vint b) {
+    return {_mm256_castsi256_ps(_mm256_cmpgt_epi32(a.v, b.v))};
+}
+
+// Lanes which are zero or positive
+inline vmask nonneg(vint a) { return a > set1(-1); }
+
+inline vfloat to_float(vint a) { return {_mm256_cvtepi32_ps(a.v)}; }
+
+// Rounded to nearest, ties to even
+inline vint to_int(vfloat a) { return {_mm256_cvtps_epi32(a.v)}; }
+
+inline void store(int32_t *p, vint a) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), a.v);
+}
+
+// width 16 bit integers, zero extended
+inline vint load(const uint16_t *p) {
+    return {_mm256_cvtepu16_epi32(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)))};
+}
+
+// Lanes must be in [0, 65535]
+inline void store(uint16_t *p, vint a) {
+    // packus works within 128 bit halves, so gather the low quadwords
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(a.v, a.v),
+                                              0xd8);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p),
+                     _mm256_castsi256_si128(packed));
+}
+#elif defined(ALPHA_SIMD_SSE2)
+constexpr uint32_t width = 4;
+
+struct vfloat { __m128 v; };
+struct vmask { __m128 v; };
+
+inline vfloat set1(float a) { return {_mm_set1_ps(a)}; }
+
+inline vfloat lanes() { return {_mm_setr_ps(0.f, 1.f, 2.f, 3.f)}; }
+
+inline vfloat load(const float *p) { return {_mm_loadu_ps(p)}; }
+
+inline void store(float *p, vfloat a) { _mm_storeu_ps(p, a.v); }
+
+inline vfloat operator+(vfloat a, vfloat b) { return {_mm_add_ps(a.v, b.v)}; }
+inline vfloat operator-(vfloat a, vfloat b) { return {_mm_sub_ps(a.v, b.v)}; }
+inline vfloat operator*(vfloat a, vfloat b) { return {_mm_mul_ps(a.v, b.v)}; }
+inline vfloat operator/(vfloat a, vfloat b) { return {_mm_div_ps(a.v, b.v)}; }
+
+inline vmask operator<(vfloat a, vfloat b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+inline vmask operator<=(vfloat a, vfloat b) { return {_mm_cmple_ps(a.v, b.v)}; }
+inline vmask operator>=(vfloat a, vfloat b) { return {_mm_cmpge_ps(a.v, b.v)}; }
+
+inline vmask operator&(vmask a, vmask b) { return {_mm_and_ps(a.v, b.v)}; }
+
+inline vfloat min(vfloat a, vfloat b) { return {_mm_min_ps(a.v, b.v)}; }
+inline vfloat max(vfloat a, vfloat b) { return {_mm_max_ps(a.v, b.v)}; }
+
+inline vfloat select(vmask m, vfloat a, vfloat b) {
+    return {_mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v))};
+}
+
+inline uint32_t bits(vmask m) {
+    return static_cast<uint32_t>(_mm_movemask_ps(m.v));
+}
+
+struct vint { __m128i v; };
+
+inline vint set1(int32_t a) { return {_mm_set1_epi32(a)}; }
+
+inline vint load(const int32_t *p) {
+    return {_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))};
+}
+
+inline vint ramp(int32_t step) {
+    auto s = static_cast<uint32_t>(step);
+    return {_mm_setr_epi32(0, int32_t(s), int32_t(2 * s), int32_t(3 * s))};
+}
+
+inline vint operator+(vint a, vint b) { return {_mm_add_epi32(a.v, b.v)}; }
+inline vint operator|(vint a, vint b) { return {_mm_or_si128(a.v, b.v)}; }
+
+inline vmask operator>(vint a, vint b) {
+    return {_mm_castsi128_ps(_mm_cmpgt_epi32(a.v, b.v))};
+}
+
+inline vmask nonneg(vint a) { return a > set1(-1); }
+
+inline vfloat to_float(vint a) { return {_mm_cvtepi32_ps(a.v)}; }
+
+inline vint to_int(vfloat a) { return {_mm_cvtps_epi32(a.v)}; }
+
+inline void store(int32_t *p, vint a) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p), a.v);
+}
+
+inline vint load(const uint16_t *p) {
+    return {_mm_unpacklo_epi16(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)),
+            _mm_setzero_si128())};
+}
+
+inline void store(uint16_t *p, vint a) {
+    // SSE2 only packs with signed saturation, so pack a - 32768 and add
+    // the 32768 back
+    __m128i s = _mm_sub_epi32(a.v, _mm_set1_epi32(32768));
+    __m128i packed = _mm_xor_si128(_mm_packs_epi32(s, s),
+                                   _mm_set1_epi16(int16_t(0x8000)));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(p), packed);
+}
+#else
+constexpr uint32_t width = 1;
+
+struct vfloat { float v; };
+struct vmask { bool v; };
+
+inline vfloat set1(float a) { return {a}; }
+
+inline vfloat lanes() { return {0.f}; }
+
+inline vfloat load(const float *p) { return {*p}; }
+
+inline void store(float *p, vfloat a) { *p = a.v; }
+
+inline vfloat operator+(vfloat a, vfloat b) { return {a.v + b.v}; }
+inline vfloat operator-(vfloat a, vfloat b) { return {a.v - b.v}; }
+inline vfloat operator*(vfloat a, vfloat b) { return {a.v * b.v}; }
+inline vfloat operator/(vfloat a, vfloat b) { return {a.v / b.v}; }
+
+inline vmask operator<(vfloat a, vfloat b) { return {a.v < b.v}; }
+inline vmask operator<=(vfloat a, vfloat b) { return {a.v <= b.v}; }
+inline vmask operator>=(vfloat a, vfloat b) { return {a.v >= b.v}; }
+
+inline vmask operator&(vmask a, vmask b) { return {a.v && b.v}; }
+
+// As minps and maxps, b when either is a NaN
+inline vfloat min(vfloat a, vfloat b) { return {a.v < b.v ? a.v : b.v}; }
+inline vfloat max(vfloat a, vfloat b) { return {b.v < a.v ? a.v : b.v}; }
+
+inline vfloat select(vmask m, vfloat a, vfloat b) { return m.v ? a : b; }
+
+inline uint32_t bits(vmask m) { return m.v ? 1u : 0u; }
+
+struct vint { int32_t v; };
+
+inline vint set1(int32_t a) { return {a}; }
+
+inline vint load(const int32_t *p) { return {*p}; }
+
+inline vint ramp(int32_t) { return {0}; }
+
+inline vint operator+(vint a, vint b) {
+    return {int32_t(uint32_t(a.v) + uint32_t(b.v))};
+}
+inline vint operator|(vint a, vint b) { return {a.v | b.v}; }
+
+inline vmask operator>(vint a, vint b) { return {a.v > b.v}; }
+
+inline vmask nonneg(vint a) { return {a.v >= 0}; }
+
+inline vfloat to_float(vint a) { return {float(a.v)}; }
+
+inline vint to_int(vfloat a) { return {int32_t(std::nearbyint(a.v))}; }
+
+inline void store(int32_t *p, vint a) { *p = a.v; }
+
+inline vint load(const uint16_t *p) { return {int32_t(*p)}; }
+
+inline void store(uint16_t *p, vint a) { *p = uint16_t(a.v); }
+#endif
+
+} // namespace simd
+} // namespace alpha
+
+#endif
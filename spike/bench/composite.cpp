@@ -0,0 +1,70 @@
+// Compare sort-last compositing against serial and binned rendering
+#include <benchmark/benchmark.h>
+#include <alpha/rasteriser.hpp>
+
+#include <cmath>
+#include <vector>
+//
+// A finely tessellated surface, like the CAD meshes the composited mode is
+// meant for: half a million triangles of a few pixels each, spread evenly
+// over the screen.
+//
+struct tessellated {
+    std::vector<alpha::math::Vec3f> vertices;
+    std::vector<uint32_t> indices;
+
+    explicit tessellated(uint32_t n) {
+        for (uint32_t j = 0; j <= n; j++) {
+            for (uint32_t i = 0; i <= n; i++) {
+                float x = 16.f * i / n - 8, y = 12.f * j / n - 6;
+                float z = -20 + std::sin(x) * std::cos(y);
+                vertices.emplace_back(x, y, z);
+            }
+        }
+        for (uint32_t j = 0; j < n; j++) {
+            for (uint32_t i = 0; i < n; i++) {
+                uint32_t a = j * (n + 1) + i, b = a + 1;
+                uint32_t c = a + n + 1, d = c + 1;
+                indices.insert(indices.end(), {a, b, c, c, b, d});
+            }
+        }
+    }
+};
+
+static std::shared_ptr<alpha::Camera> make_camera() {
+    alpha::math::Matrix44f w2cam;
+    w2cam.eye();
+    return std::make_shared<alpha::Camera>(1280, 960, 0.980f, 0.735f, 1.f,
+                                           1000.f, 20.f, w2cam);
+}
+
+static void draw(benchmark::State &state, alpha::raster_mode mode,
+                 int threads) {
+    static const tessellated mesh(500);
+    auto cam_inst = make_camera();
+    alpha::Rasteriser<> rast(cam_inst, alpha::shaders::do_nothing(), mode);
+    rast.set_num_threads(threads);
+    while (state.KeepRunning()) {
+        rast.clear();
+        rast.draw_mesh(mesh.vertices, mesh.indices);
+        rast.flush();
+    }
+    state.counters["triangles"] = double(mesh.indices.size() / 3);
+}
+
+static void BM_tessellated_serial(benchmark::State &state) {
+    draw(state, alpha::raster_mode::Immediate, 1);
+}
+
+static void BM_tessellated_binned(benchmark::State &state) {
+    draw(state, alpha::raster_mode::Binned, int(state.range(0)));
+}
+
+static void BM_tessellated_composited(benchmark::State &state) {
+    draw(state, alpha::raster_mode::Composited, int(state.range(0)));
+}
+// Register the function as a benchmark
+BENCHMARK(BM_tessellated_serial);
+BENCHMARK(BM_tessellated_binned)->RangeMultiplier(2)->Range(1, 16);
+BENCHMARK(BM_tessellated_composited)->RangeMultiplier(2)->Range(1, 16);
+BENCHMARK_MAIN();
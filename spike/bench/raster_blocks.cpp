@@ -0,0 +1,91 @@
+// Count the per-pixel edge tests saved by hierarchical traversal
+#define ALPHA_RASTER_STATS
+#include "shader.hpp"
+
+#include <random>
+
+#include <benchmark/benchmark.h>
+#include <alpha/rasteriser.hpp>
+//
+// The rasteriser classifies 8x8 blocks before testing pixels. Report how
+// many pixels a plain walk over the bounding boxes would test, against the
+// number actually tested, for the cow and for a soup of long thin triangles.
+//
+int render_triangle::id = 0;
+
+static std::shared_ptr<alpha::Camera> make_camera() {
+    const int width = 640, height = 480;
+    alpha::math::Matrix44f w2cam({0.707107f, -0.331295f, 0.624695f, 0.f,
+                                  0.f, 0.883452f, 0.468521f, 0.f,
+                                  -0.707107f, -0.331295f, 0.624695f, 0.f,
+                                  -1.63871f, -5.747777f, -40.400412f, 1.f});
+    return std::make_shared<alpha::Camera>(width, height, 0.980f, 0.735f, 1.f,
+                                           1000.f, 20.f, w2cam);
+}
+
+static void report(benchmark::State &state, const alpha::raster_stats &stats) {
+    double in_bounds = stats.pixels_in_bounds;
+    double tested = stats.pixels_tested;
+    state.counters["in_bounds"] = in_bounds;
+    state.counters["tested"] = tested;
+    state.counters["accepted"] = double(stats.blocks_accepted);
+    state.counters["rejected"] = double(stats.blocks_rejected);
+    state.counters["partial"] = double(stats.blocks_partial);
+    state.counters["occluded"] = double(stats.blocks_occluded);
+    state.counters["tiles_occluded"] = double(stats.tiles_occluded);
+    state.counters["small"] = double(stats.small_footprints);
+    state.counters["saved_%"] =
+        in_bounds > 0 ? 100 * (1 - tested / in_bounds) : 0;
+}
+
+static void BM_blocks_cow(benchmark::State &state) {
+    auto cam_inst = make_camera();
+    alpha::Rasteriser<alpha::shaders::do_nothing> rast(cam_inst);
+    const int num_tris = 3156;
+    while (state.KeepRunning()) {
+        rast.clear();
+        rast.stats.reset();
+        for (int i = 0; i < num_tris; i++) {
+            const alpha::math::Vec3f &v0 = vertices[nvertices[i * 3]];
+            const alpha::math::Vec3f &v1 = vertices[nvertices[i * 3 + 1]];
+            const alpha::math::Vec3f &v2 = vertices[nvertices[i * 3 + 2]];
+            rast.draw_triangle(v0, v1, v2);
+        }
+    }
+    report(state, rast.stats);
+}
+
+static void BM_blocks_slivers(benchmark::State &state) {
+    alpha::math::Matrix44f w2cam;
+    w2cam.eye();
+    auto cam_inst = std::make_shared<alpha::Camera>(640, 480, 0.980f, 0.735f,
+                                                    1.f, 1000.f, 20.f, w2cam);
+    // Long thin triangles at random orientations
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<float> pos(-8, 8), angle(0, 6.2831853f);
+    std::vector<alpha::math::Vec3f> tris;
+    for (int i = 0; i < 1000; i++) {
+        float cx = pos(gen), cy = pos(gen), a = angle(gen);
+        float dx = 6 * std::cos(a), dy = 6 * std::sin(a);
+        float nx = -0.05f * std::sin(a), ny = 0.05f * std::cos(a);
+        tris.emplace_back(cx - dx, cy - dy, -20.f);
+        tris.emplace_back(cx + dx, cy + dy, -20.f);
+        tris.emplace_back(cx + nx, cy + ny, -20.f);
+    }
+    alpha::Rasteriser<alpha::shaders::do_nothing> rast(cam_inst);
+    while (state.KeepRunning()) {
+        rast.clear();
+        rast.stats.reset();
+        for (size_t i = 0; i < tris.size(); i += 3) {
+            // Either winding, so that every sliver is drawn
+            if (!rast.draw_triangle(tris[i], tris[i + 1], tris[i + 2])) {
+                rast.draw_triangle(tris[i], tris[i + 2], tris[i + 1]);
+            }
+        }
+    }
+    report(state, rast.stats);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_blocks_cow);
+BENCHMARK(BM_blocks_slivers);
+BENCHMARK_MAIN();
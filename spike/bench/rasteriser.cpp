@@ -7,50 +7,74 @@
 // Use google/benchmark to benchmark rasteriser performance
 //
 int render_triangle::id = 0; // The triangle to start from
+
+const int num_tris = 3156, num_vertices = 1732;
+
+static std::shared_ptr<alpha::Camera> make_camera() {
+    const int width = 640, height = 480;
+    alpha::math::Matrix44f w2cam({0.707107f, -0.331295f, 0.624695f, 0.f,
+                                  0.f, 0.883452f, 0.468521f, 0.f,
+                                  -0.707107f, -0.331295f, 0.624695f, 0.f,
+                                  -1.63871f, -5.747777f, -40.400412f, 1.f});
+    return std::make_shared<alpha::Camera>(width, height, 0.980f, 0.735f, 1.f,
+                                           1000.f, 20.f, w2cam);
+}
+
+// Render the cow for me, one triangle at a time
+static void draw_cow(alpha::Rasteriser<render_triangle> &rast) {
+    render_triangle::id = 0;
+    for (int i = 0; i < num_tris; i++) {
+        const alpha::math::Vec3f &v0 = vertices[nvertices[i * 3]];
+        const alpha::math::Vec3f &v1 = vertices[nvertices[i * 3 + 1]];
+        const alpha::math::Vec3f &v2 = vertices[nvertices[i * 3 + 2]];
+        rast.draw_triangle(v0, v1, v2);
+        render_triangle::id++;
+    }
+}
+
 static void BM_draw_triangle(benchmark::State &state) {
     while (state.KeepRunning()) {
-        render_triangle::id = 0;
-        const int width = 640, height = 480;
-        auto cam_inst = std::make_shared<alpha::Camera>(
-            width, height, 0.980, 0.735, 1, 1000, 20,
-            std::initializer_list<std::initializer_list<float>>{
-                {0.707107, -0.331295, 0.624695, 0},
-                {0, 0.883452, 0.468521, 0},
-                {-0.707107, -0.331295, 0.624695, 0},
-                {-1.63871, -5.747777, -40.400412, 1},
-            });
-        render_triangle renderer;
-        alpha::Rasteriser<render_triangle> rast(cam_inst, renderer);
-        // Render the cow for me
-        const int num_tris = 3156;
-
-        for (int i = 0; i < num_tris; i++) {
-            const alpha::math::Vec3f &v0 = vertices[nvertices[i * 3]];
-            const alpha::math::Vec3f &v1 = vertices[nvertices[i * 3 + 1]];
-            const alpha::math::Vec3f &v2 = vertices[nvertices[i * 3 + 2]];
-            rast.draw_triangle(v0, v1, v2);
-            renderer.id++;
-        }
+        alpha::Rasteriser<render_triangle> rast(make_camera());
+        draw_cow(rast);
+    }
+}
+static void BM_draw_triangle_binned(benchmark::State &state) {
+    while (state.KeepRunning()) {
+        alpha::Rasteriser<render_triangle> rast(make_camera(),
+                                                render_triangle(),
+                                                alpha::raster_mode::Binned);
+        rast.set_num_threads(state.range(0));
+        draw_cow(rast);
+        rast.flush();
+    }
+}
+static void BM_draw_mesh(benchmark::State &state) {
+    while (state.KeepRunning()) {
+        alpha::Rasteriser<render_triangle> rast(make_camera());
+        // Transform each vertex once
+        rast.draw_mesh(vertices, num_vertices, nvertices, num_tris * 3);
+    }
+}
+static void BM_draw_mesh_deferred(benchmark::State &state) {
+    while (state.KeepRunning()) {
+        alpha::Rasteriser<render_triangle> rast(make_camera(),
+                                                render_triangle(),
+                                                alpha::raster_mode::Deferred);
+        rast.set_num_threads(state.range(0));
+        // Shade each visible pixel once
+        rast.draw_mesh(vertices, num_vertices, nvertices, num_tris * 3);
+        rast.flush();
     }
 }
 static void BM_draw_triangle_setup(benchmark::State &state) {
     while (state.KeepRunning()) {
-        render_triangle::id = 0;
-        const int width = 640, height = 480;
-        auto cam_inst = std::make_shared<alpha::Camera>(
-            width, height, 0.980, 0.735, 1, 1000, 20,
-            std::initializer_list<std::initializer_list<float>>{
-                {0.707107, -0.331295, 0.624695, 0},
-                {0, 0.883452, 0.468521, 0},
-                {-0.707107, -0.331295, 0.624695, 0},
-                {-1.63871, -5.747777, -40.400412, 1},
-            });
-        render_triangle renderer;
-        alpha::Rasteriser<render_triangle> rast(cam_inst, renderer);
-        // Render the cow for me
+        alpha::Rasteriser<render_triangle> rast(make_camera());
     }
 }
 // Register the function as a benchmark
 BENCHMARK(BM_draw_triangle);
+BENCHMARK(BM_draw_triangle_binned)->RangeMultiplier(2)->Range(1, 32);
+BENCHMARK(BM_draw_mesh);
+BENCHMARK(BM_draw_mesh_deferred)->RangeMultiplier(2)->Range(1, 32);
 BENCHMARK(BM_draw_triangle_setup);
-BENCHMARK_MAIN()
+BENCHMARK_MAIN();
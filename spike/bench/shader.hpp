@@ -9,21 +9,49 @@ typedef struct render_triangle {
 
     Vec3f operator()(float b0, float b1, float b2, float z, Vec3f v0_cam,
                      Vec3f v1_cam, Vec3f v2_cam) {
-        alpha::math::Vec2f st0 = st[stindices[id * 3]];
-        alpha::math::Vec2f st1 = st[stindices[id * 3 + 1]];
-        alpha::math::Vec2f st2 = st[stindices[id * 3 + 2]];
-        st0 *= (-1.f / v0_cam.z);
-        st1 *= (-1.f / v1_cam.z);
-        st2 *= (-1.f / v2_cam.z);
-        Vec2f st = st0 * b0 + st1 * b1 + st2 * b2;
-        st = st * z;
-        float px = (v0_cam.x / -v0_cam.z) * b0 + (v1_cam.x / -v1_cam.z) * b1 +
-                   (v2_cam.x / -v2_cam.z) * b2;
-        float py = (v0_cam.y / -v0_cam.z) * b0 + (v1_cam.y / -v1_cam.z) * b1 +
-                   (v2_cam.y / -v2_cam.z) * b2;
+        return (*this)(b0, b1, b2, z, v0_cam, v1_cam, v2_cam, id);
+    }
+
+    // Used by the rasteriser, which knows the triangle being shaded even
+    // when shading is deferred
+    Vec3f operator()(float b0, float b1, float b2, float z, Vec3f v0_cam,
+                     Vec3f v1_cam, Vec3f v2_cam, uint32_t tri) {
+        return (*this)(b0, b1, b2, z, setup(v0_cam, v1_cam, v2_cam, tri));
+    }
+
+    // What is constant over a triangle, worked out once by the rasteriser
+    // before shading its pixels
+    struct interpolants {
+        // Texture co-ordinates and projected positions divided by depth
+        Vec2f st0, st1, st2;
+        Vec2f p0, p1, p2;
+        Vec3f normal;
+    };
+
+    interpolants setup(Vec3f v0_cam, Vec3f v1_cam, Vec3f v2_cam,
+                       uint32_t tri) {
+        interpolants t;
+        t.st0 = st[stindices[tri * 3]];
+        t.st1 = st[stindices[tri * 3 + 1]];
+        t.st2 = st[stindices[tri * 3 + 2]];
+        t.st0 *= (-1.f / v0_cam.z);
+        t.st1 *= (-1.f / v1_cam.z);
+        t.st2 *= (-1.f / v2_cam.z);
+        t.p0 = Vec2f(v0_cam.x / -v0_cam.z, v0_cam.y / -v0_cam.z);
+        t.p1 = Vec2f(v1_cam.x / -v1_cam.z, v1_cam.y / -v1_cam.z);
+        t.p2 = Vec2f(v2_cam.x / -v2_cam.z, v2_cam.y / -v2_cam.z);
+        t.normal = (v1_cam - v0_cam).cross_product(v2_cam - v0_cam);
+        t.normal.normalize();
+        return t;
+    }
+
+    Vec3f operator()(float b0, float b1, float b2, float z,
+                     const interpolants &t) {
+        Vec2f st = (t.st0 * b0 + t.st1 * b1 + t.st2 * b2) * z;
+        float px = t.p0.x * b0 + t.p1.x * b1 + t.p2.x * b2;
+        float py = t.p0.y * b0 + t.p1.y * b1 + t.p2.y * b2;
         alpha::math::Vec3f pt(px * z, py * z, -z); // In camera space
-        auto normal = (v1_cam - v0_cam).cross_product(v2_cam - v0_cam);
-        normal.normalize();
+        const Vec3f &normal = t.normal;
         Vec3f view_dir = pt * -1.f;
         view_dir.normalize();
         float n_dot_alpha = normal.dot_product(view_dir);
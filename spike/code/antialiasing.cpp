@@ -33,10 +33,12 @@ int main() {
         const alpha::math::Vec3f &v0 = vertices[nvertices[i * 3]];
         const alpha::math::Vec3f &v1 = vertices[nvertices[i * 3 + 1]];
         const alpha::math::Vec3f &v2 = vertices[nvertices[i * 3 + 2]];
-		rast.draw_triangle_16xAA(v0, v1, v2);
+		rast.draw_triangle_4xMSAA(v0, v1, v2);
         renderer.id++;
     }
 
+    rast.resolve();
+
     auto t2 = high_resolution_clock::now();
     std::cout << "Time taken: " << duration_cast<milliseconds>(t2 - t1).count() << "\n";
 	  rast.dump_as_ppm("test.ppm");
@@ -1,5 +1,6 @@
 #include "shader.hpp"
 #include <chrono>
+#include <cstring>
 #include <memory>
 
 #include <SFML/Window.hpp>
@@ -26,9 +27,14 @@ auto cam_inst = std::make_shared<alpha::Camera>(
     width, height, aperture_width, aperture_height, z_near, z_far, focal_length,
     world2cam);
 render_triangle renderer;
-alpha::Rasteriser<render_triangle> rast(cam_inst, renderer);
+// RGBA8 matches the texture's layout, so frames are copied a row at a time
+alpha::Rasteriser<render_triangle, alpha::opaque_state,
+                  alpha::buffers::float_depth, alpha::buffers::linear_layout,
+                  alpha::buffers::rgba8_colour>
+    rast(cam_inst, renderer, alpha::raster_mode::Deferred);
 // Render the cow for me
 const int num_tris = 3156;
+const int num_vertices = 1732;
 
 int main() {
 
@@ -41,26 +47,14 @@ int main() {
     texture.create(width, height);
 
     auto update_texture = [&]() {
-        renderer.id = 0;
-        rast.Fbuf->clear();
-        rast.Zbuf->clear();
-        for (int i = 0; i < num_tris; i++) {
-            const alpha::math::Vec3f &v0 = vertices[nvertices[i * 3]];
-            const alpha::math::Vec3f &v1 = vertices[nvertices[i * 3 + 1]];
-            const alpha::math::Vec3f &v2 = vertices[nvertices[i * 3 + 2]];
-            rast.draw_triangle(v0, v1, v2);
-            renderer.id++;
-        }
+        rast.clear();
+        rast.draw_mesh(vertices, num_vertices, nvertices, num_tris * 3);
+        rast.flush();
         // Copy pixels
-        for (int i = 0; i < width * height * 4; i += 4) {
-            int px = i / 4;
-            int x = px % width;
-            int y = px / width;
-            auto color = rast.Fbuf->get(x, y);
-            pbuf[i] = color.x;
-            pbuf[i + 1] = color.y;
-            pbuf[i + 2] = color.z;
-            pbuf[i + 3] = 255;
+        rast.Fbuf->resolve();
+        for (int y = 0; y < height; y++) {
+            std::memcpy(pbuf + y * width * 4, rast.Fbuf->span(0, y),
+                        width * 4);
         }
         texture.update(pbuf);
     };
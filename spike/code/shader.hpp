@@ -9,23 +9,55 @@ typedef struct render_triangle {
 
     alpha::buffers::RGB operator()(float b0, float b1, float b2, float z,
         Vec3f v0_cam, Vec3f v1_cam, Vec3f v2_cam) {
-        Vec2f& st0 = (st[stindices[id * 3]]);
-        Vec2f& st1 = (st[stindices[id * 3 + 1]]);
-        Vec2f& st2 = (st[stindices[id * 3 + 2]]);
+        return (*this)(b0, b1, b2, z, v0_cam, v1_cam, v2_cam, id);
+    }
+
+    // Used by the rasteriser, which knows the triangle being shaded even
+    // when shading is deferred
+    alpha::buffers::RGB operator()(float b0, float b1, float b2, float z,
+        Vec3f v0_cam, Vec3f v1_cam, Vec3f v2_cam, uint32_t tri) {
+        return (*this)(b0, b1, b2, z, setup(v0_cam, v1_cam, v2_cam, tri));
+    }
 
-        float z0 = -z / v0_cam.z;
-        float z1 = -z / v1_cam.z;
-        float z2 = -z / v2_cam.z;
+    // What is constant over a triangle, worked out once by the rasteriser
+    // before shading its pixels
+    struct interpolants {
+        // Texture co-ordinates, vertex depths and projected positions
+        Vec2f st0, st1, st2;
+        float z0, z1, z2;
+        Vec2f p0, p1, p2;
+        Vec3f normal;
+    };
 
-        Vec2f st_cam = st0 * b0 * z0 + st1 * b1 * z1 + st2 * b2 * z2;
+    interpolants setup(Vec3f v0_cam, Vec3f v1_cam, Vec3f v2_cam,
+                       uint32_t tri) {
+        interpolants t;
+        t.st0 = st[stindices[tri * 3]];
+        t.st1 = st[stindices[tri * 3 + 1]];
+        t.st2 = st[stindices[tri * 3 + 2]];
+        t.z0 = v0_cam.z;
+        t.z1 = v1_cam.z;
+        t.z2 = v2_cam.z;
+        t.p0 = Vec2f(v0_cam.x / -v0_cam.z, v0_cam.y / -v0_cam.z);
+        t.p1 = Vec2f(v1_cam.x / -v1_cam.z, v1_cam.y / -v1_cam.z);
+        t.p2 = Vec2f(v2_cam.x / -v2_cam.z, v2_cam.y / -v2_cam.z);
+        t.normal = (v1_cam - v0_cam).cross_product(v2_cam - v0_cam);
+        t.normal.normalize();
+        return t;
+    }
+
+    alpha::buffers::RGB operator()(float b0, float b1, float b2, float z,
+        const interpolants &t) {
+        // Divided per pixel as before, so the checkerboard's edges stay put
+        float z0 = -z / t.z0;
+        float z1 = -z / t.z1;
+        float z2 = -z / t.z2;
 
-        float px = (v0_cam.x / -v0_cam.z) * b0 + (v1_cam.x / -v1_cam.z) * b1 +
-                   (v2_cam.x / -v2_cam.z) * b2;
-        float py = (v0_cam.y / -v0_cam.z) * b0 + (v1_cam.y / -v1_cam.z) * b1 +
-                   (v2_cam.y / -v2_cam.z) * b2;
+        Vec2f st_cam = t.st0 * b0 * z0 + t.st1 * b1 * z1 + t.st2 * b2 * z2;
 
-        auto normal = (v1_cam - v0_cam).cross_product(v2_cam - v0_cam);
-        normal.normalize();
+        float px = t.p0.x * b0 + t.p1.x * b1 + t.p2.x * b2;
+        float py = t.p0.y * b0 + t.p1.y * b1 + t.p2.y * b2;
+        const Vec3f &normal = t.normal;
 
         Vec3f view_dir(-px * z, -py * z, z);
         view_dir.normalize();
@@ -11,6 +11,8 @@
 ///
 //===----------------------------------------------------------------------===//
 
+#include <cstdio>
+#include <fstream>
 #include <sstream>
 
 #include <catch/catch.hpp>
@@ -95,3 +97,422 @@ TEST_CASE("Testing Imagebuffer", "[Imgbuffer]") {
         }
     }
 }
+
+TEST_CASE("Testing Zbuffer depth bounds", "[Zbuffer]") {
+    // Partial blocks and tiles along the right and bottom edges.
+    Zbuffer zbuf(100, 70, 1000.f);
+
+    SECTION("Cleared buffer is bounded by the far plane") {
+        REQUIRE(zbuf.max_depth_block(12, 8) == 1000.f);
+        REQUIRE(zbuf.max_depth_tile(1, 1) == 1000.f);
+    }
+
+    SECTION("Bounds follow updated blocks") {
+        // Cover block (12, 8), which only has 4x6 pixels in the buffer.
+        for (uint32_t y = 64; y < 70; ++y) {
+            for (uint32_t x = 96; x < 100; ++x) {
+                zbuf.set(x, y, 5.f + x - y);
+            }
+        }
+        zbuf.update_block(12, 8);
+        REQUIRE(zbuf.max_depth_block(12, 8) == 5.f + 99 - 64);
+        // The rest of the tile is still at the far plane.
+        REQUIRE(zbuf.max_depth_tile(1, 1) == 1000.f);
+
+        for (uint32_t by = 8; by < 9; ++by) {
+            for (uint32_t bx = 8; bx < 13; ++bx) {
+                for (uint32_t y = by * 8; y < 70; ++y) {
+                    for (uint32_t x = bx * 8; x < std::min(100u, bx * 8 + 8);
+                         ++x) {
+                        zbuf.set(x, y, 2.f);
+                    }
+                }
+                zbuf.update_block(bx, by);
+            }
+        }
+        REQUIRE(zbuf.max_depth_tile(1, 1) == 2.f);
+
+        zbuf.clear();
+        REQUIRE(zbuf.max_depth_block(12, 8) == 1000.f);
+        REQUIRE(zbuf.max_depth_tile(1, 1) == 1000.f);
+    }
+
+    SECTION("Setting a farther depth raises the bounds") {
+        for (uint32_t y = 0; y < 64; ++y) {
+            for (uint32_t x = 0; x < 64; ++x) {
+                zbuf.set(x, y, 2.f);
+            }
+        }
+        for (uint32_t by = 0; by < 8; ++by) {
+            for (uint32_t bx = 0; bx < 8; ++bx) {
+                zbuf.update_block(bx, by);
+            }
+        }
+        REQUIRE(zbuf.max_depth_tile(0, 0) == 2.f);
+
+        // No update_block needed
+        zbuf.set(13, 21, 7.f);
+        REQUIRE(zbuf.max_depth_block(1, 2) == 7.f);
+        REQUIRE(zbuf.max_depth_tile(0, 0) == 7.f);
+        // Nearer depths leave the bounds alone
+        zbuf.set(12, 20, 1.f);
+        REQUIRE(zbuf.max_depth_block(1, 2) == 7.f);
+    }
+}
+
+namespace {
+// Keys order depths both ways round, survive storage, and vector loads and
+// stores agree with scalar ones.
+template <typename Format>
+void require_depth_format(float tolerance) {
+    Depthbuffer<Format> zbuf(16, 4, 1000.f, 1.f);
+    const Format &fmt = zbuf.format();
+    REQUIRE(zbuf.get(3, 2) == Approx(1000.f).epsilon(1e-3));
+    float last = fmt.key(1.f);
+    for (float z = 1.5f; z < 1000.f; z *= 1.5f) {
+        float key = fmt.key(z);
+        REQUIRE_FALSE(nearer<Format>(key, last));
+        REQUIRE(fmt.key_inverse(1.f / z) == Approx(key));
+        REQUIRE_FALSE(nearer<Format>(fmt.clear_key(), key));
+        zbuf.set(1, 1, z);
+        REQUIRE(zbuf.get(1, 1) == Approx(z).epsilon(tolerance));
+        last = key;
+    }
+    REQUIRE(nearer<Format>(fmt.key(10.f), fmt.key(20.f)));
+
+    for (uint32_t x = 0; x < 16; ++x) {
+        zbuf.set(x, 0, 2.f + 3.f * x);
+    }
+    for (uint32_t x = 0; x < 16; x += alpha::simd::width) {
+        alignas(32) float keys[alpha::simd::width];
+        alpha::simd::store(keys, load_keys(zbuf.span(x, 0)));
+        for (uint32_t i = 0; i < alpha::simd::width; ++i) {
+            REQUIRE(keys[i] == float(zbuf.span(x, 0)[i]));
+        }
+        store_keys(zbuf.span(x, 1), load_keys(zbuf.span(x, 0)));
+    }
+    for (uint32_t x = 0; x < 16; ++x) {
+        REQUIRE(zbuf.get(x, 1) == zbuf.get(x, 0));
+    }
+
+    // The bounds keep the farthest key
+    zbuf.set(5, 3, 7.f);
+    zbuf.update_block(0, 0);
+    REQUIRE(zbuf.max_depth_block(0, 0) == fmt.clear_key());
+    zbuf.clear();
+    for (uint32_t y = 0; y < 4; ++y) {
+        for (uint32_t x = 0; x < 8; ++x) {
+            zbuf.set(x, y, 5.f + x);
+        }
+    }
+    zbuf.update_block(0, 0);
+    REQUIRE(zbuf.max_depth_block(0, 0) == fmt.key(12.f));
+    REQUIRE(zbuf.max_depth_tile(0, 0) == fmt.clear_key());
+}
+}
+
+TEST_CASE("Testing depth formats", "[Zbuffer]") {
+    SECTION("Float") { require_depth_format<float_depth>(0); }
+    SECTION("Reversed float") {
+        require_depth_format<reversed_float_depth>(1e-6f);
+    }
+    SECTION("24 bit unorm") { require_depth_format<unorm24_depth>(1e-3f); }
+    SECTION("16 bit unorm") {
+        REQUIRE(sizeof(unorm16_depth::type) == 2);
+        require_depth_format<unorm16_depth>(2e-2f);
+    }
+}
+
+TEST_CASE("Testing lazy clears", "[Zbuffer][Imgbuffer]") {
+    SECTION("Only the tiles written are filled") {
+        Imagebuffer img(200, 100);
+        Zbuffer zbuf(200, 100, 1000.f);
+        img.set(70, 10, 1, 2, 3);
+        zbuf.set(199, 99, 5.f);
+        REQUIRE_FALSE(img.tile_cleared(1, 0));
+        REQUIRE(img.tile_cleared(0, 0));
+        REQUIRE_FALSE(zbuf.tile_cleared(3, 1));
+        REQUIRE(zbuf.tile_cleared(2, 1));
+        REQUIRE(zbuf.get(199, 99) == 5.f);
+        REQUIRE(zbuf.get(198, 99) == 1000.f);
+        REQUIRE(zbuf.get(0, 0) == 1000.f);
+        zbuf.update_block(24, 12);
+        REQUIRE(zbuf.max_depth_block(24, 12) == 1000.f);
+
+        img.clear();
+        zbuf.clear();
+        REQUIRE(img.tile_cleared(1, 0));
+        REQUIRE(zbuf.tile_cleared(3, 1));
+        REQUIRE(zbuf.get(199, 99) == 1000.f);
+        // Written pixels reappear black once the tile is filled again
+        REQUIRE(img.get(70, 10)[0] == 0);
+        REQUIRE(img.get(71, 10)[2] == 0);
+    }
+
+    SECTION("Dumps show cleared tiles without filling them") {
+        Imagebuffer img(100, 70);
+        img.set(99, 69, 9, 9, 9);
+        img.clear();
+        img.set(0, 0, 1, 2, 3);
+        stringstream out;
+        img.dump_to_stream(out);
+        string data = out.str();
+        // The header is "P6 100 70 255 "
+        const size_t header = 14;
+        REQUIRE(data.size() == header + 100 * 70 * 3);
+        REQUIRE(data[header] == 1);
+        REQUIRE(data[header + 2] == 3);
+        REQUIRE(data[header + 3] == 0);
+        REQUIRE(data[data.size() - 1] == 0);
+        REQUIRE(img.tile_cleared(1, 1));
+    }
+}
+
+TEST_CASE("Testing tiled layouts", "[Zbuffer][Imgbuffer]") {
+    SECTION("Offsets cover the buffer once, with block rows contiguous") {
+        tiled_layout layout(130, 70);
+        REQUIRE(layout.size() == 3 * 2 * 64 * 64);
+        vector<uint8_t> seen(layout.size());
+        for (uint32_t y = 0; y < 128; ++y) {
+            for (uint32_t x = 0; x < 192; ++x) {
+                size_t o = layout.offset(x, y);
+                REQUIRE(o < layout.size());
+                REQUIRE(seen[o] == 0);
+                seen[o] = 1;
+                if (x % 8) {
+                    REQUIRE(o == layout.offset(x - 1, y) + 1);
+                }
+            }
+        }
+        // Tiles are contiguous
+        REQUIRE(layout.offset(64, 0) == 64 * 64);
+        REQUIRE(layout.offset(0, 64) == 3 * 64 * 64);
+    }
+
+    SECTION("Tiled buffers read and dump like linear ones") {
+        Imagebuffer linear(150, 90);
+        Framebuffer<rgb8_colour, tiled_layout> tiled(150, 90);
+        Zbuffer zlinear(150, 90, 1000.f);
+        Depthbuffer<float_depth, tiled_layout> ztiled(150, 90, 1000.f);
+        for (uint32_t y = 0; y < 90; ++y) {
+            for (uint32_t x = 0; x < 150; x += 1 + y % 3) {
+                uint8_t r = (x + y) % 255, g = (3 * x + y) % 255, b = y;
+                linear.set(x, y, r, g, b);
+                tiled.set(x, y, r, g, b);
+                zlinear.set(x, y, 1.f + x + y);
+                ztiled.set(x, y, 1.f + x + y);
+            }
+        }
+        stringstream a, b;
+        linear.dump_to_stream(a);
+        tiled.dump_to_stream(b);
+        REQUIRE(a.str() == b.str());
+        for (uint32_t y = 0; y < 90; ++y) {
+            for (uint32_t x = 0; x < 150; ++x) {
+                REQUIRE(zlinear.get(x, y) == ztiled.get(x, y));
+            }
+        }
+        for (uint32_t by = 0; by < 12; ++by) {
+            for (uint32_t bx = 0; bx < 19; ++bx) {
+                zlinear.update_block(bx, by);
+                ztiled.update_block(bx, by);
+                REQUIRE(zlinear.max_depth_block(bx, by) ==
+                        ztiled.max_depth_block(bx, by));
+            }
+        }
+    }
+}
+
+TEST_CASE("Testing packed colour formats", "[Imgbuffer]") {
+    SECTION("Bytes are in the format's order") {
+        uint32_t p = rgba8_colour::pack(1, 2, 3);
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&p);
+        REQUIRE(bytes[0] == 1);
+        REQUIRE(bytes[1] == 2);
+        REQUIRE(bytes[2] == 3);
+        REQUIRE(bytes[3] == 255);
+        p = bgra8_colour::pack(1, 2, 3);
+        REQUIRE(bytes[0] == 3);
+        REQUIRE(bytes[2] == 1);
+        REQUIRE(bgra8_colour::colour(p) == RGB(1, 2, 3));
+    }
+
+    SECTION("Rows are cache aligned, and dumps drop alpha") {
+        Imagebuffer rgb(75, 40);
+        Framebuffer<rgba8_colour> rgba(75, 40);
+        Framebuffer<bgra8_colour, tiled_layout> bgra(75, 40);
+        for (uint32_t y = 0; y < 40; ++y) {
+            for (uint32_t x = 0; x < 75; x += 1 + x % 2) {
+                uint8_t r = (x + y) % 255, g = (3 * x + y) % 255, b = y;
+                rgb.set(x, y, r, g, b);
+                rgba.set(x, y, r, g, b);
+                bgra.set(x, y, r, g, b);
+            }
+            rgba.resolve();
+            REQUIRE(reinterpret_cast<uintptr_t>(rgba.span(0, y)) % 64 == 0);
+        }
+        REQUIRE(rgba.get(3, 3) == RGB(6, 12, 3));
+        REQUIRE(rgba.get(4, 3) == RGB(0, 0, 0));
+        stringstream a, b, c;
+        rgb.dump_to_stream(a);
+        rgba.dump_to_stream(b);
+        bgra.dump_to_stream(c);
+        REQUIRE(a.str() == b.str());
+        REQUIRE(a.str() == c.str());
+    }
+}
+
+static string read_file(const string &name) {
+    ifstream in(name, ios::binary);
+    stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+TEST_CASE("Testing image files", "[Imgbuffer]") {
+    // More than one chunk of rows, and partly cleared
+    Imagebuffer img(1500, 1000);
+    for (uint32_t y = 0; y < 900; ++y) {
+        for (uint32_t x = 0; x < 1500; ++x) {
+            img.set(x, y, x % 256, y % 256, (x ^ y) % 256);
+        }
+    }
+    stringstream expected;
+    img.dump_to_stream(expected);
+    REQUIRE(expected.str().size() == 17 + 1500 * 1000 * 3);
+
+    const string name = "buffer_test_image.ppm";
+    img.dump_as_ppm(name);
+    REQUIRE(read_file(name) == expected.str());
+    img.dump_as_ppm(name, alpha::io::write_mode::Mapped);
+    REQUIRE(read_file(name) == expected.str());
+    remove(name.c_str());
+
+    REQUIRE_THROWS(img.dump_as_ppm("no/such/directory/image.ppm"));
+}
+
+TEST_CASE("Testing mapped image files", "[Imgbuffer]") {
+    const string name = "buffer_test_mapped.pam";
+    const string header = alpha::io::pam_header(80, 70);
+    REQUIRE(header.size() % 64 == 0);
+    {
+        Framebuffer<rgba8_colour> img(name, 80, 70);
+        REQUIRE(img.mapped());
+        REQUIRE(reinterpret_cast<uintptr_t>(img.span(0, 1)) % 64 == 0);
+        img.set(3, 2, 10, 20, 30);
+        img.set(79, 69, 40, 50, 60);
+        img.sync(true);
+    }
+    const string file = read_file(name);
+    remove(name.c_str());
+    REQUIRE(file.size() == header.size() + 80 * 70 * 4);
+    REQUIRE(file.compare(0, header.size(), header) == 0);
+    auto pixel = [&](uint32_t x, uint32_t y) {
+        return file.substr(header.size() + 4 * (y * 80 + x), 4);
+    };
+    REQUIRE(pixel(3, 2) == string("\x0a\x14\x1e\xff"));
+    REQUIRE(pixel(79, 69) == string("\x28\x32\x3c\xff"));
+    // Cleared tiles are filled by sync()
+    REQUIRE(pixel(0, 0) == string("\0\0\0\xff", 4));
+    REQUIRE(pixel(70, 3) == string("\0\0\0\xff", 4));
+
+    // Rejected before the file is created
+    REQUIRE_THROWS_AS(Framebuffer<rgba8_colour>(name, 75, 70),
+                      std::invalid_argument);
+    REQUIRE_FALSE(ifstream(name).good());
+}
+
+// A plain QOI decoder, to RGB bytes
+static vector<uint8_t> decode_qoi(const string &data, uint32_t &w,
+                                  uint32_t &h) {
+    auto u32 = [&](size_t i) {
+        return uint32_t(uint8_t(data[i])) << 24 | uint8_t(data[i + 1]) << 16 |
+               uint8_t(data[i + 2]) << 8 | uint8_t(data[i + 3]);
+    };
+    REQUIRE(data.compare(0, 4, "qoif") == 0);
+    w = u32(4);
+    h = u32(8);
+    vector<uint8_t> out;
+    uint8_t px[4] = {0, 0, 0, 255}, index[64][4] = {};
+    size_t i = 14, end = data.size() - 8;
+    int run = 0;
+    while (out.size() < size_t(w) * h * 3) {
+        if (run > 0) {
+            --run;
+        } else {
+            if (i >= end) {
+                FAIL("Truncated");
+            }
+            uint8_t b = data[i++];
+            if (b == 0xfe) {
+                for (int c = 0; c < 3; ++c) px[c] = data[i++];
+            } else if (b == 0xff) {
+                for (int c = 0; c < 4; ++c) px[c] = data[i++];
+            } else if ((b & 0xc0) == 0x00) {
+                memcpy(px, index[b], 4);
+            } else if ((b & 0xc0) == 0x40) {
+                px[0] += ((b >> 4) & 3) - 2;
+                px[1] += ((b >> 2) & 3) - 2;
+                px[2] += (b & 3) - 2;
+            } else if ((b & 0xc0) == 0x80) {
+                uint8_t b2 = data[i++];
+                int dg = (b & 0x3f) - 32;
+                px[0] += dg - 8 + (b2 >> 4);
+                px[1] += dg;
+                px[2] += dg - 8 + (b2 & 0x0f);
+            } else {
+                run = b & 0x3f;
+            }
+        }
+        const int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+        memcpy(index[slot], px, 4);
+        out.insert(out.end(), px, px + 3);
+    }
+    REQUIRE(i == end);
+    REQUIRE(data.compare(end, 8, string("\0\0\0\0\0\0\0\1", 8)) == 0);
+    return out;
+}
+
+TEST_CASE("Testing QOI output", "[Imgbuffer]") {
+    // Flat areas, gradients, noise and cleared tiles
+    Imagebuffer img(1500, 1000);
+    uint32_t seed = 1;
+    for (uint32_t y = 0; y < 900; ++y) {
+        for (uint32_t x = 0; x < 1500; ++x) {
+            seed = seed * 1664525 + 1013904223;
+            if (x < 300) {
+                img.set(x, y, 0, 0, 0);
+            } else if (x < 900) {
+                img.set(x, y, x / 4, y / 4 + x % 3, 200 - x % 7);
+            } else if (x < 1000) {
+                img.set(x, y, seed >> 24, seed >> 16, seed >> 8);
+            } else {
+                img.set(x, y, 10 + (x / 50) * 9, 60, (y / 100) * 20);
+            }
+        }
+    }
+    stringstream ppm;
+    img.dump_to_stream(ppm);
+    const string pixels = ppm.str().substr(17);
+
+    stringstream qoi;
+    img.dump_qoi_to_stream(qoi);
+    REQUIRE(qoi.str().size() < pixels.size() / 3);
+    uint32_t w, h;
+    vector<uint8_t> decoded = decode_qoi(qoi.str(), w, h);
+    REQUIRE(w == 1500);
+    REQUIRE(h == 1000);
+    REQUIRE(string(decoded.begin(), decoded.end()) == pixels);
+
+    // However many strips the rows are split into
+    for (int threads : {1, 3, 8}) {
+        stringstream strips;
+        alpha::io::write_qoi(strips, 1500, 1000,
+                             [&](uint32_t y, uint8_t *out) {
+                                 memcpy(out, &pixels[y * 4500], 4500);
+                             },
+                             threads);
+        decoded = decode_qoi(strips.str(), w, h);
+        REQUIRE(string(decoded.begin(), decoded.end()) == pixels);
+    }
+}
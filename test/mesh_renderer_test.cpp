@@ -11,10 +11,18 @@
 ///
 //===----------------------------------------------------------------------===//
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include <catch/catch.hpp>
 
 #include <alpha/math.hpp>
 #include <alpha/mesh_renderer.hpp>
+#include <alpha/rasteriser.hpp>
 
 using namespace alpha;
 using namespace alpha::math;
@@ -30,3 +38,118 @@ TEST_CASE("Testing vertex mesh renderer", "[mesh_renderer]") {
         REQUIRE_NOTHROW(MeshRenderer("cow_vert.raw", "camera_settings.cfg", "test.svg", false).render());
     }
 }
+
+TEST_CASE("Testing the culling pass", "[mesh_renderer]") {
+    Matrix44f w2cam;
+    w2cam.eye();
+    Camera cam(320, 240, 0.980f, 0.735f, 1.f, 1000.f, 20.f, w2cam);
+    std::vector<Vec3f> vertices = {
+        // Front facing
+        {-1, -1, -10}, {1, -1, -10}, {0, 1, -10},
+        // Back facing
+        {-1, -1, -10}, {0, 1, -10}, {1, -1, -10},
+        // Behind the camera
+        {-1, -1, 10}, {1, -1, 10}, {0, 1, 10},
+        // Off the left of the screen
+        {-90, -1, -10}, {-80, -1, -10}, {-85, 1, -10},
+        // Degenerate
+        {-1, -1, -10}, {0, 0, -10}, {1, 1, -10},
+        // Crossing the near plane
+        {-2, -1, -10}, {0, -1, 5}, {2, -1, -10}};
+    std::vector<culling::Vertex> projected;
+    std::vector<uint32_t> visible;
+    SECTION("Test classifying triangles") {
+        REQUIRE(culling::cull_mesh(cam, vertices.data(), 18, projected,
+                                   visible) == 2);
+        REQUIRE(visible == std::vector<uint32_t>({0, 5}));
+        visible.clear();
+        REQUIRE(culling::cull_mesh(cam, vertices.data(), 18, projected,
+                                   visible, false) == 3);
+        REQUIRE(visible == std::vector<uint32_t>({0, 1, 5}));
+    }
+    SECTION("Test indexed meshes") {
+        std::vector<uint32_t> indices = {3, 4, 5, 0, 1, 2, 0, 2, 1};
+        REQUIRE(culling::cull_mesh(cam, vertices.data(), 18, indices.data(),
+                                   9, projected, visible) == 1);
+        REQUIRE(visible == std::vector<uint32_t>({1}));
+        indices[4] = 18;
+        visible.clear();
+        REQUIRE_THROWS_AS(culling::cull_mesh(cam, vertices.data(), 18,
+                                             indices.data(), 9, projected,
+                                             visible),
+                          std::out_of_range);
+        REQUIRE(visible.empty());
+    }
+    SECTION("Test agreeing with the rasteriser") {
+        auto cam_inst = std::make_shared<Camera>("camera_settings.cfg");
+        mesh_data cow("cow_vert.raw", true);
+        Rasteriser<> rast(cam_inst);
+        culling::cull_mesh(*cam_inst, cow.vertices.data(),
+                           3 * cow.num_triangles, projected, visible);
+        std::vector<uint32_t> drawn;
+        for (uint32_t i = 0; i < cow.num_triangles; i++) {
+            if (rast.draw_triangle(cow.vertices[3 * i],
+                                   cow.vertices[3 * i + 1],
+                                   cow.vertices[3 * i + 2])) {
+                drawn.push_back(i);
+            }
+        }
+        // The rasteriser also rejects triangles between pixel centres
+        REQUIRE(!drawn.empty());
+        REQUIRE(std::includes(visible.begin(), visible.end(), drawn.begin(),
+                              drawn.end()));
+        REQUIRE(visible.size() - drawn.size() < 8);
+    }
+}
+
+TEST_CASE("Testing exported edges", "[mesh_renderer]") {
+    // A front facing triangle, and one crossing the near plane
+    const std::vector<Vec3f> tris = {{-1, -1, -10}, {1, -1, -10}, {0, 1, -10},
+                                     {-2, -1, -10}, {0, -1, 5}, {2, -1, -10}};
+    {
+        std::ofstream mesh("near_plane.raw"), camera("near_plane.cfg");
+        for (const auto &v : tris) {
+            // Stored y up
+            mesh << v.x << " " << v.z << " " << v.y << "\n";
+        }
+        camera << "320 240\n0.980 0.735\n1.0 1000.0\n20.0\n"
+                  "1 0 0 0\n0 1 0 0\n0 0 1 0\n0 0 0 1\n";
+    }
+    {
+        MeshRenderer("near_plane.raw", "near_plane.cfg", "near_plane.svg",
+                     true).render();
+    }
+    std::vector<std::string> lines;
+    std::ifstream svg("near_plane.svg");
+    for (std::string line; std::getline(svg, line);) {
+        if (line.compare(0, 5, "<line") == 0) {
+            lines.push_back(line);
+        }
+    }
+
+    Camera cam("near_plane.cfg");
+    auto raster = [&](const Vec3f &v) {
+        Vec3f r;
+        cam.project_to_raster(v, r);
+        return r;
+    };
+    auto edge = [](const Vec3f &a, const Vec3f &b) {
+        std::ostringstream ss;
+        ss << "<line x1='" << (int) a.x << "' y1 = '" << (int) a.y
+           << "' x2 = '" << (int) b.x << "' y2 ='" << (int) b.y << "'/>";
+        return ss.str();
+    };
+    // The second triangle is cut where its edges meet the near plane,
+    // z = -1, instead of reaching the mirrored projection of (0, -1, 5)
+    const Vec3f a = raster(tris[0]), b = raster(tris[1]), c = raster(tris[2]);
+    const Vec3f p = raster(tris[3]), q = raster({-0.8f, -1, -1}),
+                r = raster({0.8f, -1, -1}), t = raster(tris[5]);
+    std::vector<std::string> expected = {edge(a, b), edge(b, c), edge(c, a),
+                                         edge(p, q), edge(q, r), edge(r, t),
+                                         edge(t, p)};
+    REQUIRE(lines == expected);
+
+    std::remove("near_plane.raw");
+    std::remove("near_plane.cfg");
+    std::remove("near_plane.svg");
+}
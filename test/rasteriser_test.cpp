@@ -0,0 +1,846 @@
+//===-- rasteriser_test.cpp ---- Tests for the rasteriser -------*- C++ -*-===//
+//
+// Alpha-trace -> Minimal C++ raytracer
+//
+// Written by: Shikhar Bhardwaj | shikhar@bluefog.me
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Tests for the rasterisation modes
+///
+//===----------------------------------------------------------------------===//
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include <catch/catch.hpp>
+
+#include <alpha/math.hpp>
+#include <alpha/rasteriser.hpp>
+
+using namespace alpha;
+using namespace alpha::math;
+
+namespace {
+// Colour each pixel by the triangle it belongs to and its barycentrics, so
+// that any difference in coverage or interpolation shows up in the image.
+struct id_shader {
+    buffers::RGB operator()(float b0, float b1, float b2, float z,
+                            Vec3f v0_cam, Vec3f v1_cam, Vec3f v2_cam,
+                            uint32_t id) {
+        (void) b2;
+        (void) z;
+        (void) v0_cam;
+        (void) v1_cam;
+        (void) v2_cam;
+        return buffers::RGB(static_cast<uint8_t>(id * 37),
+                            static_cast<uint8_t>(std::min(b0, 1.f) * 255),
+                            static_cast<uint8_t>(std::min(b1, 1.f) * 255));
+    }
+};
+
+// id_shader, shading whole packets at once.
+struct packet_id_shader {
+    void operator()(const shaders::pixel_packet &p, buffers::RGB *colours) {
+        for (uint32_t i = 0; i < p.count; ++i) {
+            colours[i] = id_shader()(p.b0[i], p.b1[i], p.b2[i], p.z[i],
+                                     p.triangle.v0_cam, p.triangle.v1_cam,
+                                     p.triangle.v2_cam, p.triangle.id);
+        }
+    }
+};
+
+// id_shader, with the triangle id passed through a setup step. Copies share
+// the count of setup calls.
+struct setup_id_shader {
+    std::shared_ptr<std::atomic<uint32_t>> setups =
+            std::make_shared<std::atomic<uint32_t>>(0);
+
+    struct interpolants {
+        uint32_t id;
+    };
+
+    interpolants setup(Vec3f v0_cam, Vec3f v1_cam, Vec3f v2_cam,
+                       uint32_t id) {
+        (void) v0_cam;
+        (void) v1_cam;
+        (void) v2_cam;
+        ++*setups;
+        return {id};
+    }
+
+    buffers::RGB operator()(float b0, float b1, float b2, float z,
+                            const interpolants &t) {
+        return id_shader()(b0, b1, b2, z, Vec3f(), Vec3f(), Vec3f(), t.id);
+    }
+};
+
+// Count the pixels shaded. Copies share the count, since the binned modes
+// shade with a copy of the shader per thread.
+struct counting_shader {
+    std::shared_ptr<std::atomic<uint32_t>> calls =
+            std::make_shared<std::atomic<uint32_t>>(0);
+
+    buffers::RGB operator()(float b0, float b1, float b2, float z,
+                            Vec3f v0_cam, Vec3f v1_cam, Vec3f v2_cam) {
+        (void) b0;
+        (void) b1;
+        (void) b2;
+        (void) z;
+        (void) v0_cam;
+        (void) v1_cam;
+        (void) v2_cam;
+        ++*calls;
+        return buffers::RGB(255, 255, 255);
+    }
+};
+
+// Check that the barycentrics passed to the shader, once perspective
+// corrected, place the pixel at the depth it was drawn at, counting those
+// that do not.
+struct depth_check_shader {
+    std::shared_ptr<std::atomic<uint32_t>> calls =
+            std::make_shared<std::atomic<uint32_t>>(0);
+    std::shared_ptr<std::atomic<uint32_t>> errors =
+            std::make_shared<std::atomic<uint32_t>>(0);
+
+    buffers::RGB operator()(float b0, float b1, float b2, float z,
+                            Vec3f v0_cam, Vec3f v1_cam, Vec3f v2_cam) {
+        float l0 = b0 * z / -v0_cam.z, l1 = b1 * z / -v1_cam.z,
+              l2 = b2 * z / -v2_cam.z;
+        Vec3f p = v0_cam * l0 + v1_cam * l1 + v2_cam * l2;
+        bool inside = l0 > -1e-3f && l1 > -1e-3f && l2 > -1e-3f;
+        if (!inside || std::fabs(-p.z - z) > 1e-3f * z) {
+            ++*errors;
+        }
+        ++*calls;
+        return buffers::RGB(255, 255, 255);
+    }
+};
+
+std::shared_ptr<Camera> make_camera() {
+    Matrix44f w2cam;
+    w2cam.eye();
+    return std::make_shared<Camera>(320, 240, 0.980f, 0.735f, 1.f, 1000.f,
+                                    20.f, w2cam);
+}
+
+// A deterministic soup of overlapping triangles in front of the camera.
+std::vector<Vec3f> make_scene(uint32_t num_triangles) {
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> xy(-4.f, 4.f);
+    std::uniform_real_distribution<float> depth(-30.f, -10.f);
+    std::uniform_real_distribution<float> size(-1.5f, 1.5f);
+    std::vector<Vec3f> vertices;
+    for (uint32_t i = 0; i < num_triangles; ++i) {
+        Vec3f c(xy(gen), xy(gen), depth(gen));
+        for (int j = 0; j < 3; ++j) {
+            vertices.emplace_back(c.x + size(gen), c.y + size(gen),
+                                  c.z + size(gen));
+        }
+    }
+    return vertices;
+}
+
+template <typename Rast>
+void draw_scene(Rast &rast, const std::vector<Vec3f> &vertices) {
+    for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
+        rast.draw_triangle(vertices[i], vertices[i + 1], vertices[i + 2]);
+    }
+    rast.flush();
+}
+
+template <typename RastA, typename RastB>
+void require_same_image(RastA &a, RastB &b) {
+    uint32_t covered = 0;
+    for (int y = 0; y < a.height; ++y) {
+        for (int x = 0; x < a.width; ++x) {
+            REQUIRE(a.Zbuf->get(x, y) == b.Zbuf->get(x, y));
+            REQUIRE(a.Fbuf->get(x, y)[0] == b.Fbuf->get(x, y)[0]);
+            REQUIRE(a.Fbuf->get(x, y)[1] == b.Fbuf->get(x, y)[1]);
+            REQUIRE(a.Fbuf->get(x, y)[2] == b.Fbuf->get(x, y)[2]);
+            covered += a.Zbuf->get(x, y) < 1000.f;
+        }
+    }
+    // Make sure the scene actually covers part of the screen.
+    REQUIRE(covered > 0);
+}
+}
+
+TEST_CASE("Testing rasteriser modes", "[rasteriser]") {
+    auto cam = make_camera();
+    auto scene = make_scene(2000);
+
+    Rasteriser<id_shader> immediate(cam);
+    draw_scene(immediate, scene);
+
+    SECTION("Binned mode matches the immediate mode") {
+        Rasteriser<id_shader> binned(cam, id_shader(), raster_mode::Binned);
+        draw_scene(binned, scene);
+        require_same_image(immediate, binned);
+    }
+
+    SECTION("Indexed meshes match separate triangles") {
+        // Store each vertex once and refer to it from the index list.
+        std::vector<Vec3f> unique_vertices;
+        std::vector<uint32_t> indices;
+        for (auto it = scene.rbegin(); it != scene.rend(); ++it) {
+            unique_vertices.push_back(*it);
+        }
+        for (uint32_t i = 0; i < scene.size(); ++i) {
+            indices.push_back(static_cast<uint32_t>(scene.size()) - 1 - i);
+        }
+        for (auto mode : {raster_mode::Immediate, raster_mode::Binned}) {
+            // The geometry stage splits large meshes between the threads.
+            for (int threads : {1, 3}) {
+                Rasteriser<id_shader> indexed(cam, id_shader(), mode);
+                indexed.set_num_threads(threads);
+                indexed.draw_mesh(unique_vertices, indices);
+                indexed.flush();
+                require_same_image(immediate, indexed);
+            }
+        }
+        indices.push_back(static_cast<uint32_t>(unique_vertices.size()));
+        indices.push_back(0);
+        indices.push_back(1);
+        REQUIRE_THROWS_AS(immediate.draw_mesh(unique_vertices, indices),
+                          std::out_of_range);
+    }
+
+    SECTION("Deferred mode matches the immediate mode") {
+        Rasteriser<id_shader> deferred(cam, id_shader(),
+                                       raster_mode::Deferred);
+        draw_scene(deferred, scene);
+        require_same_image(immediate, deferred);
+    }
+
+    SECTION("Composited mode matches the immediate mode") {
+        for (int threads : {1, 3}) {
+            Rasteriser<id_shader> composited(cam, id_shader(),
+                                             raster_mode::Composited);
+            composited.set_num_threads(threads);
+            draw_scene(composited, scene);
+            require_same_image(immediate, composited);
+            // Draw over the result, so that the depth bounds are tested
+            draw_scene(composited, scene);
+            require_same_image(immediate, composited);
+        }
+    }
+
+    SECTION("Deferred mode shades each visible pixel once") {
+        Rasteriser<counting_shader> counted(cam);
+        draw_scene(counted, scene);
+        uint32_t covered = 0;
+        for (int y = 0; y < counted.height; ++y) {
+            for (int x = 0; x < counted.width; ++x) {
+                covered += counted.Zbuf->get(x, y) < 1000.f;
+            }
+        }
+        // The scene has overdraw, which the immediate mode shades.
+        REQUIRE(*counted.render_triangle.calls > covered);
+
+        counted.clear();
+        counted.set_mode(raster_mode::Deferred);
+        *counted.render_triangle.calls = 0;
+        draw_scene(counted, scene);
+        REQUIRE(*counted.render_triangle.calls == covered);
+    }
+
+    SECTION("Packet shaders match per pixel shaders") {
+        for (auto mode : {raster_mode::Immediate, raster_mode::Binned,
+                          raster_mode::Deferred}) {
+            Rasteriser<packet_id_shader> packets(cam, packet_id_shader(),
+                                                 mode);
+            draw_scene(packets, scene);
+            require_same_image(immediate, packets);
+        }
+    }
+
+    SECTION("Shader setup runs once per triangle") {
+        for (auto mode : {raster_mode::Immediate, raster_mode::Binned,
+                          raster_mode::Deferred}) {
+            Rasteriser<setup_id_shader> setup(cam, setup_id_shader(), mode);
+            uint32_t drawn = 0;
+            for (size_t i = 0; i < scene.size(); i += 3) {
+                drawn += setup.draw_triangle(scene[i], scene[i + 1],
+                                             scene[i + 2]);
+            }
+            setup.flush();
+            require_same_image(immediate, setup);
+            REQUIRE(*setup.render_triangle.setups == drawn);
+        }
+    }
+
+    SECTION("Clearing restarts triangle numbering") {
+        Rasteriser<id_shader> binned(cam, id_shader(), raster_mode::Binned);
+        draw_scene(binned, scene);
+        binned.clear();
+        draw_scene(binned, scene);
+        require_same_image(immediate, binned);
+    }
+}
+
+TEST_CASE("Testing parallel determinism", "[rasteriser]") {
+    auto cam = make_camera();
+    // Triangles on two planes facing the camera, so that most overlapping
+    // pixels tie in depth and only the submission order decides them.
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<float> xy(-5.f, 5.f);
+    std::uniform_real_distribution<float> size(-2.f, 2.f);
+    std::vector<Vec3f> scene;
+    for (uint32_t i = 0; i < 3000; ++i) {
+        float z = i % 2 ? -15.f : -20.f;
+        Vec3f c(xy(gen), xy(gen), z);
+        for (int j = 0; j < 3; ++j) {
+            scene.emplace_back(c.x + size(gen), c.y + size(gen), z);
+        }
+    }
+
+    Rasteriser<id_shader> serial(cam);
+    draw_scene(serial, scene);
+    // Make sure the order matters: drawn back to front, ties resolve
+    // differently.
+    Rasteriser<id_shader> reversed(cam);
+    for (size_t i = scene.size(); i >= 3; i -= 3) {
+        reversed.draw_triangle(scene[i - 3], scene[i - 2], scene[i - 1]);
+    }
+    bool differs = false;
+    for (int y = 0; y < serial.height && !differs; ++y) {
+        for (int x = 0; x < serial.width; ++x) {
+            if (serial.Fbuf->get(x, y)[0] != reversed.Fbuf->get(x, y)[0]) {
+                differs = true;
+                break;
+            }
+        }
+    }
+    REQUIRE(differs);
+
+    for (auto mode : {raster_mode::Binned, raster_mode::Deferred,
+                      raster_mode::Composited}) {
+        for (int threads : {1, 2, 4, 8}) {
+            Rasteriser<id_shader> parallel(cam, id_shader(), mode);
+            parallel.set_num_threads(threads);
+            draw_scene(parallel, scene);
+            require_same_image(serial, parallel);
+        }
+    }
+}
+
+TEST_CASE("Testing the fill rule", "[rasteriser]") {
+    auto cam = make_camera();
+    Rasteriser<counting_shader> rast(cam);
+
+    // Work out how world space maps to raster space on the plane z = -10.
+    Vec3f origin, unit_x, unit_y, v_cam;
+    cam->convert_to_raster(Vec3f(0, 0, -10), origin, v_cam);
+    cam->convert_to_raster(Vec3f(1, 0, -10), unit_x, v_cam);
+    cam->convert_to_raster(Vec3f(0, 1, -10), unit_y, v_cam);
+    float sx = unit_x.x - origin.x, sy = unit_y.y - origin.y;
+    // The world point which lands on raster position (x, y).
+    auto at = [&](float x, float y) {
+        return Vec3f((x - origin.x) / sx, (y - origin.y) / sy, -10);
+    };
+
+    // A grid of quads whose corners lie exactly on pixel centres, so every
+    // shared edge passes through a row or column of pixel centres.
+    const int n = 6, size = 8;
+    std::vector<Vec3f> vertices;
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+            float x0 = 100.5f + i * size, y0 = 50.5f + j * size;
+            float x1 = x0 + size, y1 = y0 + size;
+            auto tl = at(x0, y0), tr = at(x1, y0);
+            auto bl = at(x0, y1), br = at(x1, y1);
+            vertices.insert(vertices.end(), {tl, bl, tr, tr, bl, br});
+        }
+    }
+
+    SECTION("Shared edges are shaded exactly once") {
+        // Pixels covered by each triangle on its own.
+        uint32_t total = 0;
+        for (size_t i = 0; i < vertices.size(); i += 3) {
+            rast.clear();
+            *rast.render_triangle.calls = 0;
+            REQUIRE(rast.draw_triangle(vertices[i], vertices[i + 1],
+                                       vertices[i + 2]));
+            total += *rast.render_triangle.calls;
+        }
+        // Pixels covered by the whole mesh.
+        rast.clear();
+        draw_scene(rast, vertices);
+        uint32_t covered = 0;
+        for (int y = 0; y < rast.height; ++y) {
+            for (int x = 0; x < rast.width; ++x) {
+                covered += rast.Zbuf->get(x, y) < 1000.f;
+            }
+        }
+        REQUIRE(covered == n * size * n * size);
+        REQUIRE(total == covered);
+    }
+
+    SECTION("Small triangles share edges exactly once") {
+        // Quads of 1 to 3 pixels across, straddling block and tile edges
+        for (int step = 1; step <= 3; ++step) {
+            std::vector<Vec3f> small;
+            for (int j = 0; j < 8; ++j) {
+                for (int i = 0; i < 8; ++i) {
+                    float x0 = 58.5f + i * step, y0 = 60.5f + j * step;
+                    float x1 = x0 + step, y1 = y0 + step;
+                    auto tl = at(x0, y0), tr = at(x1, y0);
+                    auto bl = at(x0, y1), br = at(x1, y1);
+                    small.insert(small.end(), {tl, bl, tr, tr, bl, br});
+                }
+            }
+            uint32_t total = 0;
+            for (size_t i = 0; i < small.size(); i += 3) {
+                rast.clear();
+                *rast.render_triangle.calls = 0;
+                REQUIRE(rast.draw_triangle(small[i], small[i + 1],
+                                           small[i + 2]));
+                total += *rast.render_triangle.calls;
+            }
+            rast.clear();
+            draw_scene(rast, small);
+            uint32_t covered = 0;
+            for (int y = 0; y < rast.height; ++y) {
+                for (int x = 0; x < rast.width; ++x) {
+                    covered += rast.Zbuf->get(x, y) < 1000.f;
+                }
+            }
+            REQUIRE(covered == uint32_t(8 * step * 8 * step));
+            REQUIRE(total == covered);
+        }
+    }
+
+    SECTION("Multisampling shades once per pixel without seams") {
+        rast.clear();
+        *rast.render_triangle.calls = 0;
+        REQUIRE(rast.draw_triangle_4xMSAA(vertices[0], vertices[1],
+                                          vertices[2]));
+        rast.resolve();
+        // One shader call for every pixel the triangle touches.
+        uint32_t touched = 0;
+        for (int y = 0; y < rast.height; ++y) {
+            for (int x = 0; x < rast.width; ++x) {
+                touched += rast.Fbuf->get(x, y)[0] > 0;
+            }
+        }
+        REQUIRE(touched > 0);
+        REQUIRE(*rast.render_triangle.calls == touched);
+
+        rast.clear();
+        for (size_t i = 0; i < vertices.size(); i += 3) {
+            rast.draw_triangle_4xMSAA(vertices[i], vertices[i + 1],
+                                      vertices[i + 2]);
+        }
+        rast.resolve();
+        // Every sample inside the grid is covered...
+        for (int y = 51; y < 98; ++y) {
+            for (int x = 101; x < 148; ++x) {
+                REQUIRE(rast.Fbuf->get(x, y)[0] == 255);
+            }
+        }
+        // ...and its border is anti-aliased.
+        for (int y = 51; y < 98; ++y) {
+            REQUIRE(rast.Fbuf->get(100, y)[0] > 0);
+            REQUIRE(rast.Fbuf->get(100, y)[0] < 255);
+            REQUIRE(rast.Fbuf->get(148, y)[0] > 0);
+            REQUIRE(rast.Fbuf->get(148, y)[0] < 255);
+        }
+    }
+}
+
+TEST_CASE("Testing depth bounds after Zbuf writes", "[rasteriser]") {
+    auto cam = make_camera();
+    Rasteriser<counting_shader> rast(cam);
+    // A square of side 2 * s at depth z, covering the whole screen
+    auto square = [&](float s, float z) {
+        rast.draw_triangle({-s, s, z}, {-s, -s, z}, {s, s, z});
+        rast.draw_triangle({s, s, z}, {-s, -s, z}, {s, -s, z});
+    };
+    square(10, -5);
+    // Push every depth back past where the next square is drawn
+    for (int y = 0; y < rast.height; ++y) {
+        for (int x = 0; x < rast.width; ++x) {
+            rast.Zbuf->set(x, y, 1000.f);
+        }
+    }
+    *rast.render_triangle.calls = 0;
+
+    square(100, -50);
+    REQUIRE(*rast.render_triangle.calls == uint32_t(rast.width * rast.height));
+    for (int y = 0; y < rast.height; ++y) {
+        for (int x = 0; x < rast.width; ++x) {
+            REQUIRE(rast.Zbuf->get(x, y) == Approx(50.f));
+        }
+    }
+}
+
+TEST_CASE("Testing clipping", "[rasteriser]") {
+    auto cam = make_camera();
+    Rasteriser<depth_check_shader> rast(cam);
+
+    SECTION("Triangles behind the camera are culled") {
+        REQUIRE_FALSE(rast.draw_triangle(Vec3f(-1, -1, 5), Vec3f(1, -1, 5),
+                                         Vec3f(0, 1, 5)));
+        REQUIRE(*rast.render_triangle.calls == 0);
+    }
+
+    SECTION("Triangles crossing the near plane are clipped") {
+        // One vertex behind the camera, one between it and the near plane
+        REQUIRE(rast.draw_triangle(Vec3f(-2, -1, -10), Vec3f(0, -1, 5),
+                                   Vec3f(2, -1, -10)));
+        REQUIRE(rast.draw_triangle(Vec3f(-2, 1, -10), Vec3f(2, 1, -10),
+                                   Vec3f(0, 1, -0.5f)));
+        REQUIRE(*rast.render_triangle.calls > 0);
+        REQUIRE(*rast.render_triangle.errors == 0);
+    }
+
+    SECTION("Triangles far outside the screen are clipped") {
+        REQUIRE(rast.draw_triangle(Vec3f(-1e6f, -1e6f, -20),
+                                   Vec3f(1e6f, -1e6f, -20),
+                                   Vec3f(0, 1e6f, -20)));
+        REQUIRE(*rast.render_triangle.calls ==
+                uint32_t(rast.width * rast.height));
+        REQUIRE(*rast.render_triangle.errors == 0);
+    }
+}
+
+TEST_CASE("Testing occlusion queries", "[rasteriser]") {
+    auto cam = make_camera();
+    Rasteriser<counting_shader> rast(cam);
+    // An indexed square of side 2 * s at depth z, facing the camera
+    auto square = [](float s, float z) {
+        return std::vector<Vec3f>{{-s, s, z}, {-s, -s, z}, {s, s, z},
+                                  {s, -s, z}};
+    };
+    const std::vector<uint32_t> indices = {0, 1, 2, 2, 1, 3};
+    auto checksum = [&]() {
+        uint64_t sum = 0;
+        for (int y = 0; y < rast.height; ++y) {
+            for (int x = 0; x < rast.width; ++x) {
+                sum = sum * 31 + uint64_t(rast.Zbuf->get(x, y) * 1024);
+                sum = sum * 31 + rast.Fbuf->get(x, y)[0];
+            }
+        }
+        return sum;
+    };
+
+    for (auto mode : {raster_mode::Immediate, raster_mode::Binned}) {
+        rast.clear();
+        rast.set_mode(mode);
+        // Queued occluder, drawn when the query begins
+        rast.draw_mesh(square(2, -10), indices);
+        rast.begin_query();
+        REQUIRE(*rast.render_triangle.calls > 0);
+        const uint64_t before = checksum();
+        *rast.render_triangle.calls = 0;
+
+        // Hidden behind the occluder
+        rast.draw_mesh(square(1, -20), indices);
+        REQUIRE(rast.end_query() == 0);
+
+        // In front of it, one sample per pixel covered
+        auto front = square(1, -5);
+        rast.begin_query();
+        rast.draw_triangle(front[0], front[1], front[2]);
+        rast.draw_triangle(front[2], front[1], front[3]);
+        uint64_t samples = rast.end_query();
+        REQUIRE(samples > 0);
+
+        // Neither buffer is written, and nothing is shaded
+        REQUIRE(*rast.render_triangle.calls == 0);
+        REQUIRE(checksum() == before);
+
+        rast.begin_query(occlusion_query::AnySamples);
+        rast.draw_mesh(front, indices);
+        uint64_t any = rast.end_query();
+        // Testing stops at the first sample passing
+        REQUIRE(any == 1);
+
+        rast.draw_mesh(front, indices);
+        rast.flush();
+        REQUIRE(*rast.render_triangle.calls == samples);
+    }
+
+    SECTION("Queries leave cleared depth tiles cleared") {
+        rast.clear();
+        auto front = square(1, -5);
+        rast.begin_query();
+        rast.draw_mesh(front, indices);
+        uint64_t samples = rast.end_query();
+        REQUIRE(samples > 0);
+        rast.begin_query(occlusion_query::AnySamples);
+        rast.draw_mesh(front, indices);
+        REQUIRE(rast.end_query() == 1);
+        for (int ty = 0; ty * 64 < rast.height; ++ty) {
+            for (int tx = 0; tx * 64 < rast.width; ++tx) {
+                REQUIRE(rast.Zbuf->tile_cleared(tx, ty));
+            }
+        }
+
+        // The samples counted are those drawn
+        *rast.render_triangle.calls = 0;
+        rast.draw_mesh(front, indices);
+        rast.flush();
+        REQUIRE(*rast.render_triangle.calls == samples);
+    }
+
+    SECTION("Multisampled triangles") {
+        rast.clear();
+        auto draw_msaa = [&](const std::vector<Vec3f> &v) {
+            rast.draw_triangle_4xMSAA(v[0], v[1], v[2]);
+            rast.draw_triangle_4xMSAA(v[2], v[1], v[3]);
+        };
+        draw_msaa(square(2, -10));
+        // The sample depths, and the samples differing from them
+        std::vector<float> before;
+        auto changed = [&]() {
+            uint64_t n = 0;
+            for (int y = 0; y < rast.height; ++y) {
+                for (int x = 0; x < rast.width; ++x) {
+                    const float *d = rast.MSbuf->depths(x, y);
+                    for (int s = 0; s < 4; ++s) {
+                        size_t i = (size_t(y) * rast.width + x) * 4 + s;
+                        if (i >= before.size()) {
+                            before.push_back(d[s]);
+                        } else if (before[i] != d[s]) {
+                            n++;
+                        }
+                    }
+                }
+            }
+            return n;
+        };
+        changed();
+        *rast.render_triangle.calls = 0;
+
+        rast.begin_query();
+        draw_msaa(square(1, -20));
+        REQUIRE(rast.end_query() == 0);
+
+        auto front = square(1, -5);
+        rast.begin_query();
+        draw_msaa(front);
+        uint64_t samples = rast.end_query();
+        REQUIRE(samples > 0);
+        REQUIRE(*rast.render_triangle.calls == 0);
+        REQUIRE(changed() == 0);
+
+        rast.begin_query(occlusion_query::AnySamples);
+        draw_msaa(front);
+        uint64_t any = rast.end_query();
+        REQUIRE(any == 1);
+
+        // Drawn for real, exactly the samples counted are written
+        draw_msaa(front);
+        REQUIRE(*rast.render_triangle.calls > 0);
+        REQUIRE(changed() == samples);
+    }
+}
+
+TEST_CASE("Testing pipeline states", "[rasteriser]") {
+    auto cam = make_camera();
+    auto scene = make_scene(500);
+
+    SECTION("Depth only passes never shade or touch the Imagebuffer") {
+        Rasteriser<counting_shader> opaque(cam);
+        draw_scene(opaque, scene);
+        for (auto mode : {raster_mode::Immediate, raster_mode::Binned,
+                          raster_mode::Deferred, raster_mode::Composited}) {
+            Rasteriser<counting_shader, depth_only_state> depth(cam);
+            depth.set_mode(mode);
+            depth.set_num_threads(3);
+            draw_scene(depth, scene);
+            REQUIRE(*depth.render_triangle.calls == 0);
+            for (int y = 0; y < depth.height; ++y) {
+                for (int x = 0; x < depth.width; ++x) {
+                    REQUIRE(depth.Zbuf->get(x, y) == opaque.Zbuf->get(x, y));
+                    REQUIRE(depth.Fbuf->get(x, y)[0] == 0);
+                }
+            }
+        }
+    }
+
+    SECTION("Cull modes") {
+        const Vec3f v0(-1, -1, -10), v1(1, -1, -10), v2(0, 1, -10);
+        Rasteriser<counting_shader> back(cam);
+        REQUIRE(back.draw_triangle(v0, v1, v2));
+        REQUIRE_FALSE(back.draw_triangle(v0, v2, v1));
+        const uint32_t pixels = *back.render_triangle.calls;
+        REQUIRE(pixels > 0);
+
+        Rasteriser<counting_shader,
+                   pipeline_state<true, true, true, cull_mode::Front>>
+                front(cam);
+        REQUIRE_FALSE(front.draw_triangle(v0, v1, v2));
+        REQUIRE(front.draw_triangle(v0, v2, v1));
+        REQUIRE(*front.render_triangle.calls == pixels);
+
+        Rasteriser<counting_shader,
+                   pipeline_state<true, true, true, cull_mode::None>>
+                none(cam);
+        REQUIRE(none.draw_triangle(v0, v2, v1));
+        REQUIRE(*none.render_triangle.calls == pixels);
+        none.clear();
+        REQUIRE(none.draw_triangle(v0, v1, v2));
+        REQUIRE(*none.render_triangle.calls == 2 * pixels);
+    }
+
+    SECTION("Overlays are drawn in order and leave depth alone") {
+        Rasteriser<id_shader, overlay_state> overlay(cam);
+        // Back facing, and behind the first
+        overlay.draw_triangle(Vec3f(-1, -1, -10), Vec3f(1, -1, -10),
+                              Vec3f(0, 1, -10));
+        overlay.draw_triangle(Vec3f(-1, -1, -20), Vec3f(0, 1, -20),
+                              Vec3f(1, -1, -20));
+        const int x = overlay.width / 2, y = overlay.height / 2;
+        REQUIRE(overlay.Fbuf->get(x, y)[0] == uint8_t(37));
+        REQUIRE(overlay.Zbuf->get(x, y) ==
+                cam->get_far_clipping_plain());
+    }
+
+    SECTION("Depth without perspective correction") {
+        Rasteriser<> persp(cam);
+        Rasteriser<shaders::do_nothing,
+                   pipeline_state<true, true, true, cull_mode::Back, false>>
+                linear(cam);
+        const Vec3f v0(-2, -1, -5), v1(2, -1, -30), v2(0, 2, -10);
+        persp.draw_triangle(v0, v1, v2);
+        linear.draw_triangle(v0, v1, v2);
+        uint32_t covered = 0, further = 0;
+        for (int y = 0; y < persp.height; ++y) {
+            for (int x = 0; x < persp.width; ++x) {
+                float p = persp.Zbuf->get(x, y), l = linear.Zbuf->get(x, y);
+                REQUIRE((p < 1000.f) == (l < 1000.f));
+                if (p < 1000.f) {
+                    // Means of the vertex depths, harmonic and arithmetic
+                    REQUIRE(l >= p * (1 - 1e-5f));
+                    REQUIRE(l <= 30.f * (1 + 1e-5f));
+                    covered++;
+                    further += l > p * 1.01f;
+                }
+            }
+        }
+        REQUIRE(covered > 0);
+        REQUIRE(further > 0);
+    }
+}
+
+namespace {
+// Every mode gives the same image with depth format Depth, and it differs
+// from the float_depth image at few pixels: only where the format cannot
+// tell apart depths close enough to tie.
+template <typename Depth>
+void require_depth_format(const std::vector<Vec3f> &scene,
+                          double max_different) {
+    auto cam = make_camera();
+    Rasteriser<id_shader> reference(cam);
+    draw_scene(reference, scene);
+    Rasteriser<id_shader, opaque_state, Depth> immediate(cam);
+    draw_scene(immediate, scene);
+    for (auto mode : {raster_mode::Binned, raster_mode::Deferred,
+                      raster_mode::Composited}) {
+        Rasteriser<id_shader, opaque_state, Depth> other(cam, id_shader(),
+                                                         mode);
+        other.set_num_threads(3);
+        draw_scene(other, scene);
+        require_same_image(immediate, other);
+    }
+    uint32_t covered = 0, different = 0;
+    for (int y = 0; y < immediate.height; ++y) {
+        for (int x = 0; x < immediate.width; ++x) {
+            float z = reference.Zbuf->get(x, y);
+            REQUIRE((z < 1000.f) ==
+                    (immediate.Fbuf->get(x, y)[0] ||
+                     immediate.Fbuf->get(x, y)[1] ||
+                     immediate.Fbuf->get(x, y)[2]));
+            if (z < 1000.f) {
+                covered++;
+                different += immediate.Fbuf->get(x, y)[0] !=
+                             reference.Fbuf->get(x, y)[0];
+                REQUIRE(std::fabs(immediate.Zbuf->get(x, y) - z) <
+                        z * 1e-2f);
+            }
+        }
+    }
+    REQUIRE(covered > 0);
+    REQUIRE(different <= covered * max_different);
+}
+}
+
+TEST_CASE("Testing depth formats", "[rasteriser]") {
+    auto scene = make_scene(500);
+    SECTION("Reversed float") {
+        require_depth_format<buffers::reversed_float_depth>(scene, 1e-3);
+    }
+    SECTION("24 bit unorm") {
+        require_depth_format<buffers::unorm24_depth>(scene, 1e-3);
+    }
+    SECTION("16 bit unorm") {
+        require_depth_format<buffers::unorm16_depth>(scene, 2e-2);
+    }
+}
+
+TEST_CASE("Testing tiled layouts", "[rasteriser]") {
+    auto cam = make_camera();
+    auto scene = make_scene(1000);
+    Rasteriser<id_shader> linear(cam);
+    draw_scene(linear, scene);
+    for (auto mode : {raster_mode::Immediate, raster_mode::Binned,
+                      raster_mode::Deferred, raster_mode::Composited}) {
+        Rasteriser<id_shader, opaque_state, buffers::float_depth,
+                   buffers::tiled_layout>
+                tiled(cam, id_shader(), mode);
+        tiled.set_num_threads(3);
+        draw_scene(tiled, scene);
+        require_same_image(linear, tiled);
+    }
+}
+
+TEST_CASE("Testing packed colour formats", "[rasteriser]") {
+    auto cam = make_camera();
+    auto scene = make_scene(1000);
+    Rasteriser<id_shader> rgb(cam);
+    draw_scene(rgb, scene);
+    for (auto mode : {raster_mode::Immediate, raster_mode::Binned,
+                      raster_mode::Deferred, raster_mode::Composited}) {
+        Rasteriser<id_shader, opaque_state, buffers::float_depth,
+                   buffers::linear_layout, buffers::rgba8_colour>
+                rgba(cam, id_shader(), mode);
+        rgba.set_num_threads(3);
+        draw_scene(rgba, scene);
+        require_same_image(rgb, rgba);
+        Rasteriser<packet_id_shader, opaque_state, buffers::float_depth,
+                   buffers::tiled_layout, buffers::bgra8_colour>
+                bgra(cam, packet_id_shader(), mode);
+        bgra.set_num_threads(3);
+        draw_scene(bgra, scene);
+        require_same_image(rgb, bgra);
+    }
+}
+
+TEST_CASE("Testing rendering into image files", "[rasteriser]") {
+    auto cam = make_camera();
+    auto scene = make_scene(1000);
+    using Rgba = Rasteriser<id_shader, opaque_state, buffers::float_depth,
+                            buffers::linear_layout, buffers::rgba8_colour>;
+    Rgba memory(cam, id_shader(), raster_mode::Binned);
+    draw_scene(memory, scene);
+    memory.Fbuf->resolve();
+    Rgba mapped(cam, id_shader(), raster_mode::Binned);
+    const std::string name = "rasteriser_test_image.pam";
+    mapped.map_image(name);
+    draw_scene(mapped, scene);
+    mapped.sync_image();
+    require_same_image(memory, mapped);
+    for (int y = 0; y < memory.height; y++) {
+        REQUIRE(std::memcmp(memory.Fbuf->span(0, y), mapped.Fbuf->span(0, y),
+                            memory.width * 4) == 0);
+    }
+    std::remove(name.c_str());
+}